@@ -21,6 +21,9 @@
 #import "index.h"
 
 #include <ESP8266WiFi.h>          //https://github.com/esp8266/Arduino
+extern "C" {
+#include "user_interface.h"
+}
 
 //needed for library
 #include <DNSServer.h>
@@ -29,21 +32,88 @@
 
 #include <ArduinoJson.h>          //https://github.com/bblanchon/ArduinoJson
 #include <PubSubClient.h>
-#include <base64.h>
-#include <ESP8266HTTPClient.h>
 
 //libs for lcd
 #include <Wire.h>  
 #include "SSD1306Wire.h" 
 #include "logo.h"
+#include "ringdetector.h"
+#include "pressclassifier.h"
+#include "inputhistory.h"
+#include "coalescer.h"
+#include "latency.h"
+#include "journal.h"
+#include "outbox.h"
+#include "dnscache.h"
+#include "tls.h"
+#include "backoff.h"
+#include "connection.h"
+#include "httpresponse.h"
+#include "templates.h"
+#include "mqttqos.h"
+#include "dispatcher.h"
+#include "udpnotify.h"
 
-int doorbellState = 0;
 int resetState = 0;
 const int doorbellPin = 14;
 
+//Input edges are captured by an interrupt into a ring buffer which is drained by the sample
+//timer, so a press is never missed while the loop is busy with the display, webserver or mqtt.
+//There is one producer (the ISR, only writes edgeHead) and one consumer (the sample timer, only
+//writes edgeTail), so no locking is needed. When the buffer is full new edges are dropped, which
+//keeps the first edges of a press (the ones that matter) and counts the rest as overflow.
+#define EDGE_BUFFER_SIZE 64  //must be a power of 2
+
+struct edgeEvent {
+  uint32_t us;    //micros() timestamp of the edge
+  uint16_t pins;  //snapshot of the GPIO0-15 input register at the time of the edge
+};
+
+volatile edgeEvent edgeBuffer[EDGE_BUFFER_SIZE];
+volatile uint8_t edgeHead = 0;
+volatile uint8_t edgeTail = 0;
+volatile uint32_t edgeOverflows = 0;
+
+//The inputs are sampled by timer1 at a fixed rate into bit packed histories (see inputhistory.h)
+//and the ring detectors run in that same interrupt, fed by the captured edges. Ring detection
+//therefore does not depend on how long loop() takes: a ring is reported at most ring window + 1
+//sample period after its first pulse, and its end at most silence gap + 1 sample period after
+//its last pulse. Every detection is checked against that bound, with one more sample period for
+//the interrupt latency, and the misses are counted on /metrics. The detected rings are queued for loop().
+//The level the detectors see is the majority of the last LEVEL_FILTER_SAMPLES samples, so a one
+//sample glitch does not end a held input.
+#define SAMPLE_RATE_HZ 1000
+#define SAMPLE_PERIOD_US (1000000UL / SAMPLE_RATE_HZ)
+#define RESET_DEBOUNCE_SAMPLES 20
+#define LEVEL_FILTER_SAMPLES 3
+
+volatile uint32_t resetHistory = 0;
+
+#define RING_QUEUE_SIZE 8  //must be a power of 2
+
+struct ringRecord {
+  uint8_t event;     //RING_STARTED or RING_ENDED
+  uint8_t channel;
+  uint32_t startUs;
+  uint32_t endUs;
+};
+
+volatile ringRecord ringQueue[RING_QUEUE_SIZE];
+volatile uint8_t ringHead = 0;
+volatile uint8_t ringTail = 0;
+volatile uint32_t maxDetectUs = 0;  //longest time from the first pulse of a ring to its detection
+volatile uint32_t detectBoundMisses = 0;  //detections that took longer than the bound
+
+//PubSubClient talks to the broker through mqttTransport, which hands the PUBACKs of the QoS 1
+//messages written by mqttPublisher to it (see mqttqos.h). It runs over mqttTls when the broker
+//fingerprint is set and TLS is built in (see tls.h).
 WiFiClient espClient;
-HTTPClient http; 
-PubSubClient client(espClient);
+#if TLS_SUPPORT
+PinnedTlsClient mqttTls;
+#endif
+MqttAckClient mqttTransport(espClient);
+PubSubClient client(mqttTransport);
+MqttPublisher mqttPublisher(mqttTransport);
 
 WiFiManager wifiManager;
 ESP8266WebServer server(80);
@@ -60,9 +130,185 @@ char mqtt_username[40];
 char mqtt_password[40];
 char mqtt_topic[40];
 char mqtt_status[60] = "unknown";
+char mqtt_qos[2] = "1";  //QoS of the notifications, 0 or 1
+char mqtt_persistent[4] = "off";  //"on" to connect with clean session off, the broker keeps the session
+char mqtt_fingerprint[60] = "";  //SHA1 fingerprint of the broker certificate, connects with tls when set
+char mqtt_mode[6] = "state";  //"state": a retained 'on' and 'off' per ring, "event": one ring message with the hold time
+char mqtt_client_id[24];  //doorbell-modernizr-<chip id>, unique for every device on the broker
+ConnectRate mqttConnects;
 
 char dz_idx[5];
 char oh_itemid[40];
+char oh_events[4] = "off";  //"on" to send the press events to the String item <itemId>_event, which has to exist
+
+//ring detection settings
+char ring_min_freq[6] = "40";    //minimum pulse frequency in Hz
+char ring_min_pulses[4] = "3";   //pulses needed within the window to start a ring
+char ring_window[6] = "100";     //window in ms
+char ring_gap[6] = "200";        //silence in ms that ends a ring
+char long_press[6] = "1000";     //a ring of at least this many ms is a long press
+char multi_window[6] = "600";    //rings starting within this many ms after the previous one are a double/multi ring
+
+//notification settings
+char coalesce_window[7] = "5000";  //rings within this many ms after the previous one are folded into one notification, at most HOLD_TIME
+char rate_limit[4] = "10";          //maximum notifications per minute for each backend, 0 is unlimited
+
+//power settings
+char idle_sleep[4] = "off";  //"on" to light sleep while there is nothing to do
+
+//network settings
+char tcp_nodelay[4] = "on";  //"on" to switch Nagle's algorithm off on the backend connections
+char http_fingerprint[60] = "";  //SHA1 fingerprint of the Domoticz/openHAB certificate, https when set
+
+//lan datagram settings: a multicast group or a comma separated list of addresses, no targets is no datagrams
+char udp_targets[64] = "";
+char udp_port[6] = "4210";
+char udp_copies[3] = "3";  //every ring or press is sent this many times, 1 to 5
+
+//webhook settings, the path, headers and body can hold the fields of templates.h, like {event} or {seq}.
+//Header lines are separated by '|'. No host is no webhook.
+char webhook_host[40] = "";
+char webhook_port[6] = "1880";
+char webhook_fingerprint[60] = "";  //https when set
+char webhook_method[8] = "POST";
+char webhook_path[80] = "/doorbell";
+char webhook_headers[120] = "Content-Type: application/json";
+char webhook_body[200] = "{\"event\":\"{event}\",\"state\":\"{state}\",\"channel\":{channel},\"count\":{count},"
+                         "\"duration\":{duration},\"seq\":{seq},\"uptime\":{uptime}}";
+
+//extra input channels, see setupChannels()
+#define MAX_CHANNELS 3
+
+struct channelSettings {
+  char pin[3];     //empty when the channel is not used
+  char type[8];    //"bell" or "contact"
+  char active[5];  //"low" or "high"
+  char topic[40];
+  char idx[5];
+  char item[40];
+  //ring detector of a bell channel, empty is the setting of the doorbell
+  char minFreq[6];
+  char minPulses[4];
+  char window[6];
+  char gap[6];
+};
+
+channelSettings extraChannels[MAX_CHANNELS - 1];
+
+//Press lifecycle, the 'off' message of every backend is sent HOLD_TIME ms after its 'on'
+#define HOLD_TIME 5000
+enum { BACKEND_MQTT, BACKEND_DOMOTICZ, BACKEND_OPENHAB, BACKEND_WEBHOOK, BACKEND_COUNT };
+static_assert(BACKEND_COUNT <= 4, "the journal has 2 delivery bits for 4 backends");
+
+//Input channels. Channel 0 is the doorbell on GPIO14 with the main topic, idx and itemId,
+//the others are the configured extra inputs: another doorbell or a door contact. A bell
+//channel goes through the ring detector, classifier and coalescer and holds 'on' for
+//HOLD_TIME, a contact channel is debounced and is 'on' for as long as it is active.
+enum { CHANNEL_BELL, CHANNEL_CONTACT };
+#define CONTACT_DEBOUNCE 50  //ms
+
+struct inputChannel {
+  uint8_t pin;
+  uint8_t type;
+  uint8_t activeHigh;
+  const char *topic;  //mqtt topic, Domoticz idx and openHAB itemId, empty when not used
+  const char *idx;
+  const char *item;
+
+  //used by the sample timer interrupt
+  RingDetector detector;
+  volatile uint32_t history;
+
+  //used by loop()
+  PressClassifier classifier;
+  RingCoalescer coalescer;
+  bool offPending[BACKEND_COUNT];
+  unsigned long offDueMillis[BACKEND_COUNT];
+  unsigned int ringsInHold;
+  uint32_t journalSeq;  //journal record of the current ring
+  channelRequests requests;
+};
+
+inputChannel channels[MAX_CHANNELS];
+volatile uint8_t channelCount = 0;
+
+RateLimiter backendLimiter[BACKEND_COUNT];
+
+//The parts of the notification requests that only depend on the settings are rendered once by
+//setupTemplates() (see templates.h), the per channel parts are in channelRequests.
+FixedText<288> domoticzTail;    //credentials, http version and headers
+FixedText<192> openhabHeaders;  //http version and headers, up to the value of the content length
+FixedText<128> webhookHead;     //http version, host and the fixed headers
+FixedText<160> webhookHeaderLines;  //the configured headers, one per line
+PayloadTemplate webhookPath;
+PayloadTemplate webhookHeaders;
+PayloadTemplate webhookBody;
+bool webhookEnabled = false;
+
+//Press to notify latency: every 'on' message is traced through its stages (see latencyTrace)
+//and the time spent in each stage goes into a histogram.
+//The histograms are served on /metrics and published on <topic>/metrics/<backend>.
+enum { STAGE_DISPATCH, STAGE_CONNECT, STAGE_WRITE, STAGE_RESPONSE, STAGE_TOTAL, STAGE_COUNT };
+#define METRICS_INTERVAL 300000
+
+LatencyHistogram latency[BACKEND_COUNT][STAGE_COUNT];
+unsigned long lastMetricsMillis = 0;
+
+//Every ring and press is written to a journal in flash (see journal.h) together with the result
+//per backend, so rings that were missed while a backend was down can be found afterwards on /journal.
+//The journal sectors sit right below SPIFFS, in the part of the sketch area the sketch does not use:
+//with the 512K (64K SPIFFS) layout the sketch has to stay below 412K, else the journal is disabled.
+//Uploading with "Erase flash: Only sketch" keeps the journal.
+#define JOURNAL_PAGE_SIZE 32
+#define JOURNAL_MAX_PAGE_SIZE 128
+
+extern "C" uint32_t _SPIFFS_start;
+FlashJournal journal;
+
+//Messages that could not be delivered are queued (see outbox.h) and replayed in order: for mqtt
+//as soon as the connection is back, for Domoticz and openHAB when a retry gets through.
+//A replayed ring or press is sent as an event with its sequence number and time, the 'on' state
+//is not sent again so nothing rings long after the fact.
+#define OUTBOX_IN_RTC true  //keep the queue over a soft reset
+#define OUTBOX_RETRY_INTERVAL 10000
+
+Outbox outbox;
+bool replaying[BACKEND_COUNT];  //replay the outbox of the backend whenever it is free
+unsigned long lastOutboxRetryMillis = 0;
+
+//The mqtt connection is tried again from loop() with a growing, randomized wait (see backoff.h),
+//so a fleet of doorbells does not hit a restarted broker all at once. A message that could not be
+//sent because the connection is down gets an attempt right away, unless the other backends have
+//messages on the way: connecting blocks loop(). It is bounded like the http connects (see
+//connection.h), the broker gets as long to answer the connect.
+#define MQTT_RETRY_MIN 1000
+#define MQTT_RETRY_MAX 60000
+
+Backoff mqttBackoff;
+
+//The server name is resolved once and the address is used for every connect (see dnscache.h)
+DnsCache dnsCache;
+
+//Rings and presses as udp datagrams on the local network (see udpnotify.h)
+UdpNotifier udpNotifier;
+
+//Idle sleep: when there is nothing to do, loop() stops the sample timer and waits in delay(), so
+//the wifi can go to light sleep between beacons (the mqtt connection stays up). The input pins and
+//the reset button are switched to a level interrupt that wakes the chip; the first interrupt switches
+//them back to edge capture, stamps the wake up and ends the delay() right away with esp_schedule(),
+//so the sample timer runs again within a few us. The edges are buffered, so nothing is lost; the wake
+//to publish time is measured. How much of the wait the chip really slept is up to the sdk, only the
+//time spent waiting is counted.
+#define IDLE_SLEEP_MS 100
+#define RESET_PIN 12
+
+extern "C" void esp_schedule();
+
+volatile bool idleSleeping = false;
+volatile uint32_t wakeUs = 0;  //time of the last wake up by an input, 0 when handled
+uint32_t sleepCount = 0;
+uint32_t idleWaitMillis = 0;  //time spent waiting in idleSleep(), asleep or not
+LatencyHistogram wakeLatency;
 
 //flag for saving data
 bool shouldSaveConfig = false;
@@ -110,6 +356,33 @@ void handleRoot() {
     configPage.replace("{6}", mqtt_status);
     configPage.replace("{7}", dz_idx);
     configPage.replace("{8}", oh_itemid);
+    configPage.replace("{9}", ring_min_freq);
+    configPage.replace("{10}", ring_min_pulses);
+    configPage.replace("{11}", ring_window);
+    configPage.replace("{12}", ring_gap);
+    configPage.replace("{13}", long_press);
+    configPage.replace("{14}", multi_window);
+    configPage.replace("{15}", coalesce_window);
+    configPage.replace("{16}", rate_limit);
+    configPage.replace("{18}", idle_sleep);
+    configPage.replace("{19}", tcp_nodelay);
+    configPage.replace("{20}", mqtt_qos);
+    configPage.replace("{21}", mqtt_persistent);
+    configPage.replace("{31}", mqtt_mode);
+    configPage.replace("{35}", oh_events);
+    configPage.replace("{32}", mqtt_fingerprint);
+    configPage.replace("{33}", http_fingerprint);
+    configPage.replace("{34}", webhook_fingerprint);
+    configPage.replace("{22}", webhook_host);
+    configPage.replace("{23}", webhook_port);
+    configPage.replace("{24}", webhook_method);
+    configPage.replace("{25}", webhook_path);
+    configPage.replace("{26}", webhook_headers);
+    configPage.replace("{27}", webhook_body);
+    configPage.replace("{28}", udp_targets);
+    configPage.replace("{29}", udp_port);
+    configPage.replace("{30}", udp_copies);
+    configPage.replace("{17}", channelSettingsHtml());
     
     server.send(200, "text/html", configPage);
   }
@@ -117,6 +390,7 @@ void handleRoot() {
 
 void saveSettings() {
   Serial.println("Handling webserver request savesettings");
+  releaseChannels();
 
   //store the updates values in the json config file
     DynamicJsonBuffer jsonBuffer;
@@ -129,6 +403,48 @@ void saveSettings() {
 
     json["dz_idx"] = server.arg("dz_idx");
     json["oh_itemid"] = server.arg("oh_itemid");
+
+    json["ring_min_freq"] = server.arg("ring_min_freq");
+    json["ring_min_pulses"] = server.arg("ring_min_pulses");
+    json["ring_window"] = server.arg("ring_window");
+    json["ring_gap"] = server.arg("ring_gap");
+    json["long_press"] = server.arg("long_press");
+    json["multi_window"] = server.arg("multi_window");
+    json["coalesce_window"] = server.arg("coalesce_window");
+    json["rate_limit"] = server.arg("rate_limit");
+    json["idle_sleep"] = server.arg("idle_sleep");
+    json["tcp_nodelay"] = server.arg("tcp_nodelay");
+    json["mqtt_qos"] = server.arg("mqtt_qos");
+    json["mqtt_persistent"] = server.arg("mqtt_persistent");
+    json["mqtt_mode"] = server.arg("mqtt_mode");
+    json["oh_events"] = server.arg("oh_events");
+    json["mqtt_fingerprint"] = server.arg("mqtt_fingerprint");
+    json["http_fingerprint"] = server.arg("http_fingerprint");
+    json["webhook_fingerprint"] = server.arg("webhook_fingerprint");
+    json["webhook_host"] = server.arg("webhook_host");
+    json["webhook_port"] = server.arg("webhook_port");
+    json["webhook_method"] = server.arg("webhook_method");
+    json["webhook_path"] = server.arg("webhook_path");
+    json["webhook_headers"] = server.arg("webhook_headers");
+    json["webhook_body"] = server.arg("webhook_body");
+    json["udp_targets"] = server.arg("udp_targets");
+    json["udp_port"] = server.arg("udp_port");
+    json["udp_copies"] = server.arg("udp_copies");
+
+    for (int i = 0; i < MAX_CHANNELS - 1; i++) {
+      String prefix = "ch" + String(i + 2) + "_";
+      server.arg(prefix + "pin").toCharArray(extraChannels[i].pin, sizeof(extraChannels[i].pin));
+      server.arg(prefix + "type").toCharArray(extraChannels[i].type, sizeof(extraChannels[i].type));
+      server.arg(prefix + "active").toCharArray(extraChannels[i].active, sizeof(extraChannels[i].active));
+      server.arg(prefix + "topic").toCharArray(extraChannels[i].topic, sizeof(extraChannels[i].topic));
+      server.arg(prefix + "idx").toCharArray(extraChannels[i].idx, sizeof(extraChannels[i].idx));
+      server.arg(prefix + "item").toCharArray(extraChannels[i].item, sizeof(extraChannels[i].item));
+      server.arg(prefix + "min_freq").toCharArray(extraChannels[i].minFreq, sizeof(extraChannels[i].minFreq));
+      server.arg(prefix + "min_pulses").toCharArray(extraChannels[i].minPulses, sizeof(extraChannels[i].minPulses));
+      server.arg(prefix + "window").toCharArray(extraChannels[i].window, sizeof(extraChannels[i].window));
+      server.arg(prefix + "gap").toCharArray(extraChannels[i].gap, sizeof(extraChannels[i].gap));
+    }
+    writeChannelSettings(json);
    
     File configFile = SPIFFS.open("/config.json", "w");
     if (!configFile) {
@@ -147,11 +463,40 @@ void saveSettings() {
     server.arg("mqtt_topic").toCharArray(mqtt_topic,40);
     server.arg("dz_idx").toCharArray(dz_idx,40);
     server.arg("oh_itemid").toCharArray(oh_itemid,40);
+    server.arg("ring_min_freq").toCharArray(ring_min_freq, sizeof(ring_min_freq));
+    server.arg("ring_min_pulses").toCharArray(ring_min_pulses, sizeof(ring_min_pulses));
+    server.arg("ring_window").toCharArray(ring_window, sizeof(ring_window));
+    server.arg("ring_gap").toCharArray(ring_gap, sizeof(ring_gap));
+    server.arg("long_press").toCharArray(long_press, sizeof(long_press));
+    server.arg("multi_window").toCharArray(multi_window, sizeof(multi_window));
+    server.arg("coalesce_window").toCharArray(coalesce_window, sizeof(coalesce_window));
+    server.arg("rate_limit").toCharArray(rate_limit, sizeof(rate_limit));
+    server.arg("idle_sleep").toCharArray(idle_sleep, sizeof(idle_sleep));
+    server.arg("tcp_nodelay").toCharArray(tcp_nodelay, sizeof(tcp_nodelay));
+    server.arg("mqtt_qos").toCharArray(mqtt_qos, sizeof(mqtt_qos));
+    server.arg("mqtt_persistent").toCharArray(mqtt_persistent, sizeof(mqtt_persistent));
+    server.arg("mqtt_mode").toCharArray(mqtt_mode, sizeof(mqtt_mode));
+    server.arg("oh_events").toCharArray(oh_events, sizeof(oh_events));
+    server.arg("mqtt_fingerprint").toCharArray(mqtt_fingerprint, sizeof(mqtt_fingerprint));
+    server.arg("http_fingerprint").toCharArray(http_fingerprint, sizeof(http_fingerprint));
+    server.arg("webhook_fingerprint").toCharArray(webhook_fingerprint, sizeof(webhook_fingerprint));
+    server.arg("webhook_host").toCharArray(webhook_host, sizeof(webhook_host));
+    server.arg("webhook_port").toCharArray(webhook_port, sizeof(webhook_port));
+    server.arg("webhook_method").toCharArray(webhook_method, sizeof(webhook_method));
+    server.arg("webhook_path").toCharArray(webhook_path, sizeof(webhook_path));
+    server.arg("webhook_headers").toCharArray(webhook_headers, sizeof(webhook_headers));
+    server.arg("webhook_body").toCharArray(webhook_body, sizeof(webhook_body));
+    server.arg("udp_targets").toCharArray(udp_targets, sizeof(udp_targets));
+    server.arg("udp_port").toCharArray(udp_port, sizeof(udp_port));
+    server.arg("udp_copies").toCharArray(udp_copies, sizeof(udp_copies));
+    setupChannels();
+    setupSleep();
+    setupConnections();
    
     server.send(200, "text/html", "Settings have been saved. You will be redirected to the configuration page in 5 seconds <meta http-equiv=\"refresh\" content=\"5; url=/\" />");
     
     //mqtt settings might have changed, let's reconnect to the mqtt server if one is configured
-    if (strlen(mqtt_topic) != 0){
+    if (mqttConfigured()){
       Serial.println("mqtt topic set, need to connect");
       reconnect();
     }
@@ -162,13 +507,13 @@ void setup() {
 
   Serial.begin(115200);
   Serial.println();
+  snprintf(mqtt_client_id, sizeof(mqtt_client_id), "doorbell-modernizr-%06x", ESP.getChipId());
 
   //initialize lcd display
   display.init();
   display.flipScreenVertically();
   display.setFont(ArialMT_Plain_10);
 
-  pinMode(doorbellPin, INPUT_PULLUP);
   pinMode(12, INPUT_PULLUP);
   pinMode(BUILTIN_LED, OUTPUT);
  
@@ -203,6 +548,59 @@ void setup() {
           strcpy(dz_idx, json["dz_idx"]);
           strcpy(oh_itemid, json["oh_itemid"]);
 
+          //ring detection settings are not present in older config files
+          if (json.containsKey("ring_min_freq")) {
+            strlcpy(ring_min_freq, json["ring_min_freq"], sizeof(ring_min_freq));
+            strlcpy(ring_min_pulses, json["ring_min_pulses"], sizeof(ring_min_pulses));
+            strlcpy(ring_window, json["ring_window"], sizeof(ring_window));
+            strlcpy(ring_gap, json["ring_gap"], sizeof(ring_gap));
+          }
+          if (json.containsKey("long_press")) {
+            strlcpy(long_press, json["long_press"], sizeof(long_press));
+            strlcpy(multi_window, json["multi_window"], sizeof(multi_window));
+          }
+          if (json.containsKey("coalesce_window")) {
+            strlcpy(coalesce_window, json["coalesce_window"], sizeof(coalesce_window));
+            strlcpy(rate_limit, json["rate_limit"], sizeof(rate_limit));
+          }
+          if (json.containsKey("idle_sleep")) {
+            strlcpy(idle_sleep, json["idle_sleep"], sizeof(idle_sleep));
+          }
+          if (json.containsKey("tcp_nodelay")) {
+            strlcpy(tcp_nodelay, json["tcp_nodelay"], sizeof(tcp_nodelay));
+          }
+          if (json.containsKey("mqtt_qos")) {
+            strlcpy(mqtt_qos, json["mqtt_qos"], sizeof(mqtt_qos));
+          }
+          if (json.containsKey("mqtt_persistent")) {
+            strlcpy(mqtt_persistent, json["mqtt_persistent"], sizeof(mqtt_persistent));
+          }
+          if (json.containsKey("mqtt_mode")) {
+            strlcpy(mqtt_mode, json["mqtt_mode"], sizeof(mqtt_mode));
+          }
+          if (json.containsKey("oh_events")) {
+            strlcpy(oh_events, json["oh_events"], sizeof(oh_events));
+          }
+          if (json.containsKey("mqtt_fingerprint")) {
+            strlcpy(mqtt_fingerprint, json["mqtt_fingerprint"], sizeof(mqtt_fingerprint));
+            strlcpy(http_fingerprint, json["http_fingerprint"], sizeof(http_fingerprint));
+            strlcpy(webhook_fingerprint, json["webhook_fingerprint"], sizeof(webhook_fingerprint));
+          }
+          if (json.containsKey("webhook_host")) {
+            strlcpy(webhook_host, json["webhook_host"], sizeof(webhook_host));
+            strlcpy(webhook_port, json["webhook_port"], sizeof(webhook_port));
+            strlcpy(webhook_method, json["webhook_method"], sizeof(webhook_method));
+            strlcpy(webhook_path, json["webhook_path"], sizeof(webhook_path));
+            strlcpy(webhook_headers, json["webhook_headers"], sizeof(webhook_headers));
+            strlcpy(webhook_body, json["webhook_body"], sizeof(webhook_body));
+          }
+          if (json.containsKey("udp_targets")) {
+            strlcpy(udp_targets, json["udp_targets"], sizeof(udp_targets));
+            strlcpy(udp_port, json["udp_port"], sizeof(udp_port));
+            strlcpy(udp_copies, json["udp_copies"], sizeof(udp_copies));
+          }
+          readChannelSettings(json);
+
         } else {
           Serial.println("failed to load json config");
         }
@@ -212,6 +610,19 @@ void setup() {
     Serial.println("failed to mount FS");
   }
   //end read
+  setupDispatcher();
+  setupConnections();
+  mqttBackoff.configure(MQTT_RETRY_MIN, MQTT_RETRY_MAX);
+  mqttTransport.onAck = mqttAcked;
+  setupSleep();
+  setupJournal();
+  outbox.begin(OUTBOX_IN_RTC);
+  if (outbox.size() != 0) {
+    Serial.print("undelivered messages from before the reset: ");
+    Serial.println(outbox.size());
+  }
+  setupChannels();
+  startSampler();
 
   WiFiManagerParameter custom_mqtt_server("server", "ip address", mqtt_server, 40);
   WiFiManagerParameter custom_mqtt_port("port", "port", mqtt_port, 5);
@@ -276,6 +687,8 @@ void setup() {
   //Define url's for webserver 
   server.on("/", handleRoot);
   server.on("/saveSettings", saveSettings);
+  server.on("/metrics", handleMetrics);
+  server.on("/journal", handleJournal);
   server.onNotFound([]() {
     handleRoot();
   });
@@ -290,6 +703,7 @@ void setup() {
 
   strcpy(dz_idx, custom_dz_idx.getValue());
   strcpy(oh_itemid, custom_oh_itemid.getValue());
+  setupChannels();
 
   //save the custom parameters to FS
   if (shouldSaveConfig) {
@@ -303,6 +717,33 @@ void setup() {
     json["mqtt_topic"] = mqtt_topic;
     json["dz_idx"] = dz_idx;
     json["oh_itemid"] = oh_itemid;
+    json["ring_min_freq"] = ring_min_freq;
+    json["ring_min_pulses"] = ring_min_pulses;
+    json["ring_window"] = ring_window;
+    json["ring_gap"] = ring_gap;
+    json["long_press"] = long_press;
+    json["multi_window"] = multi_window;
+    json["coalesce_window"] = coalesce_window;
+    json["rate_limit"] = rate_limit;
+    json["idle_sleep"] = idle_sleep;
+    json["tcp_nodelay"] = tcp_nodelay;
+    json["mqtt_qos"] = mqtt_qos;
+    json["mqtt_persistent"] = mqtt_persistent;
+    json["mqtt_mode"] = mqtt_mode;
+    json["oh_events"] = oh_events;
+    json["mqtt_fingerprint"] = mqtt_fingerprint;
+    json["http_fingerprint"] = http_fingerprint;
+    json["webhook_fingerprint"] = webhook_fingerprint;
+    json["webhook_host"] = webhook_host;
+    json["webhook_port"] = webhook_port;
+    json["webhook_method"] = webhook_method;
+    json["webhook_path"] = webhook_path;
+    json["webhook_headers"] = webhook_headers;
+    json["webhook_body"] = webhook_body;
+    json["udp_targets"] = udp_targets;
+    json["udp_port"] = udp_port;
+    json["udp_copies"] = udp_copies;
+    writeChannelSettings(json);
 
     File configFile = SPIFFS.open("/config.json", "w");
     if (!configFile) {
@@ -328,11 +769,17 @@ void reconnect() {
 
   
   client.disconnect();
-  client.setServer(mqtt_server, atoi(mqtt_port));
+  IPAddress address;
+  bool resolved = dnsCache.resolve(mqtt_server, address);
+  if (resolved) {
+    client.setServer(address, atoi(mqtt_port));
+  }
   Serial.print("Attempting MQTT connection to ");
   Serial.print(mqtt_server);
   Serial.print(" on port ");
   Serial.print(mqtt_port);
+  Serial.print(" as ");
+  Serial.print(mqtt_client_id);
   Serial.print("...");
 
   display.clear();
@@ -343,21 +790,41 @@ void reconnect() {
     display.drawString(0, 20, "Attempting MQtt connection");
     display.display();
   
-  if (client.connect("ESP8266Client", mqtt_username, mqtt_password)) {
+  //with a persistent session the broker keeps the subscriptions and the QoS 1 messages for the client id
+  bool cleanSession = strcmp(mqtt_persistent, "on") != 0;
+  if (resolved && client.connect(mqtt_client_id, mqtt_username, mqtt_password, NULL, 0, false, NULL, cleanSession)) {
      Serial.println("connected");
+     mqttConnects.add(millis());
+     mqttSocket().setNoDelay(strcmp(tcp_nodelay, "on") == 0);
      String("<div style=\"color:green;float:left\">connected</div>").toCharArray(mqtt_status,60);
-     Serial.print("sending 'off' message to ");
-     Serial.print(mqtt_server);
-     Serial.print(" on port ");
-     Serial.print(mqtt_port);
-     Serial.print(" with topic ");
-     Serial.println(mqtt_topic);
-     client.publish(mqtt_topic, "off" , true);
+     for (int c = 0; c < channelCount; c++) {
+       if (ringEvents(c)) {
+         //no state on the topic, clear the one retained before the switch to event mode
+         publishState(channels[c].topic, "");
+       } else if (channels[c].offPending[BACKEND_MQTT]) {
+         //holding after a ring: the 'on' is on its way or in the outbox, the 'off' follows at the end of the hold
+       } else if (channelBackendEnabled(c, BACKEND_MQTT)) {
+         bool on = channels[c].type == CHANNEL_CONTACT && channels[c].detector.ringing();
+         Serial.print(on ? "sending 'on' message to " : "sending 'off' message to ");
+         Serial.print(mqtt_server);
+         Serial.print(" on port ");
+         Serial.print(mqtt_port);
+         Serial.print(" with topic ");
+         Serial.println(channels[c].topic);
+         publishState(channels[c].topic, on ? "on" : "off");
+       }
+     }
+     mqttPublisher.resend();
+     mqttBackoff.succeeded();
+     replaying[BACKEND_MQTT] = true;
    } else {
+     mqttBackoff.failed(millis());
      Serial.print("failed, rc=");
      String("<div style=\"color:red;float:left\">connection failed</div>").toCharArray(mqtt_status,60);
      Serial.print(client.state());
-     Serial.println(" try again in 5 seconds");
+     Serial.print(" try again in ");
+     Serial.print(mqttBackoff.waitMs);
+     Serial.println(" ms");
 
     display.clear();
     display.setTextAlignment(TEXT_ALIGN_LEFT);
@@ -368,89 +835,1298 @@ void reconnect() {
     display.drawString(0, 40, "reconfigure at");
     display.drawString(0, 50, "http://" + WiFi.localIP().toString());
     display.display();
-
-    unsigned long previousMillis1 = 0;
-
-     //connection failed, Go into a (non-blocking) loop until we are connected 
-     while (!client.connected()) {
-        resetstate();
-         server.handleClient();  //call to handle webserver connection needed, because the while loop will block the processor
-         unsigned long currentMillis1 = millis();
-         if(currentMillis1 - previousMillis1 >= 5000) {
-         previousMillis1 = currentMillis1;
-         Serial.print("Attempting MQTT connection...");
-          if (client.connect("ESP8266Client", mqtt_username, mqtt_password)) {
-                Serial.println("connected");
-                String("<div style=\"color:green;float:left\">connected</div>").toCharArray(mqtt_status,60);
-             } else {
-                     String("<div style=\"color:red;float:left\">connection failed</div>").toCharArray(mqtt_status,60);
-                Serial.print("failed, rc=");
-                Serial.print(client.state());
-                Serial.println(" try again in 5 seconds");
-             }
-         }
-      }
+    //loop() tries again when the backoff allows it, rings are queued meanwhile
    }
 }
 
 long lastMsg = 0;
 
-//Initialize a reset if pin 12 is low
-void resetstate (){
-   resetState = digitalRead(12);
-   if (resetState == LOW){
-    Serial.println("It seems someone wants to go for a reset...");
+//Only pins that are not used by the flash, serial port, display, led, reset button or doorbell.
+//GPIO0 and GPIO15 select the boot mode, their idle level must be the one the esp boots with:
+//GPIO0 high, so only active low with the pull-up, GPIO15 low, so only active high with a
+//pull-down (it has no pull-up).
+bool channelPinAllowed(int pin, bool activeHigh) {
+  switch (pin) {
+    case 0:
+      return !activeHigh;
+    case 13:
+      return true;
+    case 15:
+      return activeHigh;
+    default:
+      return false;
+  }
+}
 
-    display.clear();
-    display.setTextAlignment(TEXT_ALIGN_LEFT);
-    display.setFont(ArialMT_Plain_10);
-    display.drawString(0, 0, "Doorbell modernizr");
-    display.drawString(0, 20, "Keep reset button pressed");
-    display.drawString(0, 30, "for 5 seconds to reset");
-    display.drawString(0, 40, "and erase all settings");
-    display.display();
-    
-    int count = 0;
+//A channel detector setting, or the doorbell one when it is empty
+int detectorSetting(const char *setting, const char *doorbell) {
+  return atoi(setting[0] != 0 ? setting : doorbell);
+}
 
-    //Flash the led for 5 seconds
-    while (count < 25 && digitalRead(12) == LOW) {
-      digitalWrite(BUILTIN_LED, HIGH);   
-      delay(100);                      
-      digitalWrite(BUILTIN_LED, LOW);    
-      delay(100);                      
-      count ++;
+//End the holds of the channels before their settings change: the pending 'off' messages are sent
+//now, the channel table is rebuilt without them
+void releaseChannels() {
+  for (int c = 0; c < channelCount; c++) {
+    for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+      if (channels[c].offPending[backend]) {
+        channels[c].offPending[backend] = false;
+        sendOff(c, backend);
+      }
     }
-  
-    resetState = digitalRead(12);
-    //See if they still want to go for it
-    if (resetState == LOW){
-       Serial.println("Let's do it");
-       SPIFFS.format();
-       wifiManager.resetSettings();
-       delay(500);
-       ESP.restart();  
+    channels[c].ringsInHold = 0;
+  }
+}
+
+//Build the channel table from the settings and (re)configure the inputs, call releaseChannels()
+//first when it is already in use
+void setupChannels() {
+  for (int c = 0; c < channelCount; c++) {
+    detachInterrupt(digitalPinToInterrupt(channels[c].pin));
+  }
+
+  noInterrupts();
+  channelCount = 0;
+  interrupts();
+
+  for (int c = 0; c < MAX_CHANNELS; c++) {
+    inputChannel &ch = channels[channelCount];
+    if (c == 0) {
+      ch.pin = doorbellPin;
+      ch.type = CHANNEL_BELL;
+      ch.activeHigh = false;
+      ch.topic = mqtt_topic;
+      ch.idx = dz_idx;
+      ch.item = oh_itemid;
+    } else {
+      channelSettings &settings = extraChannels[c - 1];
+      if (strlen(settings.pin) == 0) {
+        continue;
+      }
+      bool activeHigh = strcmp(settings.active, "high") == 0;
+      if (!channelPinAllowed(atoi(settings.pin), activeHigh)) {
+        Serial.print("Input pin not allowed: ");
+        Serial.print(settings.pin);
+        Serial.println(activeHigh ? " active high" : " active low");
+        continue;
+      }
+      ch.pin = atoi(settings.pin);
+      ch.type = strcmp(settings.type, "contact") == 0 ? CHANNEL_CONTACT : CHANNEL_BELL;
+      ch.activeHigh = activeHigh;
+      ch.topic = settings.topic;
+      ch.idx = settings.idx;
+      ch.item = settings.item;
+    }
+
+    //GPIO15 has no pull-up, active high inputs need a pull-down anyway
+    pinMode(ch.pin, ch.activeHigh ? INPUT : INPUT_PULLUP);
+    if (ch.type == CHANNEL_CONTACT) {
+      //never enough pulses, so only a level held for the debounce time starts a ring
+      ch.detector.configure(1000, 255, CONTACT_DEBOUNCE, CONTACT_DEBOUNCE);
+    } else if (c == 0) {
+      ch.detector.configure(atoi(ring_min_freq), atoi(ring_min_pulses), atoi(ring_window), atoi(ring_gap));
     } else {
-      drawDefaultScreen();
-      Serial.println("They chickened out...");
-      Serial.println("Now starting AP");
+      channelSettings &settings = extraChannels[c - 1];
+      ch.detector.configure(detectorSetting(settings.minFreq, ring_min_freq), detectorSetting(settings.minPulses, ring_min_pulses),
+                            detectorSetting(settings.window, ring_window), detectorSetting(settings.gap, ring_gap));
+    }
+    ch.detector.reset(digitalRead(ch.pin) ^ ch.activeHigh);
+    ch.history = 0;
+    ch.classifier = PressClassifier();
+    ch.classifier.configure(atoi(long_press), atoi(multi_window));
+    ch.coalescer = RingCoalescer();
+    //a folded ring extends the hold, a longer window would fold rings after the 'off' was sent
+    ch.coalescer.windowMs = std::min(atol(coalesce_window), (long)HOLD_TIME);
+    for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+      ch.offPending[backend] = false;
+    }
+    ch.ringsInHold = 0;
+
+    noInterrupts();
+    channelCount++;
+    interrupts();
+    attachInterrupt(digitalPinToInterrupt(ch.pin), inputInterrupt, CHANGE);
+  }
+
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    backendLimiter[backend].configure(atoi(rate_limit));
+  }
+  setupTemplates();
+}
+
+//Render the parts of the notification requests that only change with the settings
+void setupTemplates() {
+  domoticzTail.clear();
+  if (strlen(mqtt_username) != 0) {
+    domoticzTail.add("&username=").addBase64(mqtt_username).add("&password=").addBase64(mqtt_password);
+  }
+  domoticzTail.add(" HTTP/1.1\r\nHost: ").add(mqtt_server).add(":").add(mqtt_port)
+              .add("\r\nUser-Agent: doorbell-modernizr\r\nConnection: keep-alive\r\n\r\n");
+
+  openhabHeaders.clear();
+  openhabHeaders.add(" HTTP/1.1\r\nHost: ").add(mqtt_server).add(":").add(mqtt_port)
+                .add("\r\nUser-Agent: doorbell-modernizr\r\nContent-Type: text/plain\r\nConnection: keep-alive\r\nContent-Length: ");
+
+  for (int c = 0; c < channelCount; c++) {
+    channelRequests &requests = channels[c].requests;
+    requests.mqttEventTopic.clear();
+    requests.mqttEventTopic.add(channels[c].topic).add("/event");
+    requests.domoticzState.clear();
+    requests.domoticzState.add("GET /json.htm?type=command&param=udevice&idx=").add(channels[c].idx).add("&nvalue=");
+    requests.openhabItem.clear();
+    requests.openhabItem.add("POST /rest/items/").add(channels[c].item);
+  }
+
+  webhookHead.clear();
+  webhookHead.add(" HTTP/1.1\r\nHost: ").add(webhook_host).add(":").add(webhook_port)
+             .add("\r\nUser-Agent: doorbell-modernizr\r\nConnection: keep-alive\r\n");
+  webhookHeaderLines.clear();
+  for (const char *line = webhook_headers; *line != 0; ) {
+    const char *end = strchr(line, '|');
+    size_t len = end != NULL ? end - line : strlen(line);
+    while (len > 0 && isspace(line[len - 1])) {
+      len--;
+    }
+    while (len > 0 && isspace(*line)) {
+      line++;
+      len--;
+    }
+    if (len > 0) {
+      webhookHeaderLines.add(line, len).add("\r\n");
+    }
+    line = end != NULL ? end + 1 : line + strlen(line);
+  }
+  webhookEnabled = strlen(webhook_host) != 0;
+  if (webhookEnabled && (webhookHeaderLines.overflowed() || !webhookPath.compile(webhook_path) ||
+                         !webhookHeaders.compile(webhookHeaderLines.c_str()) || !webhookBody.compile(webhook_body))) {
+    Serial.println("webhook templates too long or too many fields, webhook disabled");
+    webhookEnabled = false;
+  }
+}
 
-      
-      boolean result = false;
-      while (result == false){
+//Put the extra channel settings into the json config
+void writeChannelSettings(JsonObject& json) {
+  JsonArray& channelsJson = json.createNestedArray("channels");
+  for (int i = 0; i < MAX_CHANNELS - 1; i++) {
+    JsonObject& channel = channelsJson.createNestedObject();
+    channel["pin"] = extraChannels[i].pin;
+    channel["type"] = extraChannels[i].type;
+    channel["active"] = extraChannels[i].active;
+    channel["topic"] = extraChannels[i].topic;
+    channel["idx"] = extraChannels[i].idx;
+    channel["item"] = extraChannels[i].item;
+    channel["min_freq"] = extraChannels[i].minFreq;
+    channel["min_pulses"] = extraChannels[i].minPulses;
+    channel["window"] = extraChannels[i].window;
+    channel["gap"] = extraChannels[i].gap;
+  }
+}
+
+//Read the extra channel settings from the json config, not present in older config files
+void readChannelSettings(JsonObject& json) {
+  if (!json.containsKey("channels")) {
+    return;
+  }
+  JsonArray& channelsJson = json["channels"];
+  for (int i = 0; i < MAX_CHANNELS - 1 && i < (int)channelsJson.size(); i++) {
+    JsonObject& channel = channelsJson[i];
+    copySetting(extraChannels[i].pin, channel["pin"], sizeof(extraChannels[i].pin));
+    copySetting(extraChannels[i].type, channel["type"], sizeof(extraChannels[i].type));
+    copySetting(extraChannels[i].active, channel["active"], sizeof(extraChannels[i].active));
+    copySetting(extraChannels[i].topic, channel["topic"], sizeof(extraChannels[i].topic));
+    copySetting(extraChannels[i].idx, channel["idx"], sizeof(extraChannels[i].idx));
+    copySetting(extraChannels[i].item, channel["item"], sizeof(extraChannels[i].item));
+    copySetting(extraChannels[i].minFreq, channel["min_freq"], sizeof(extraChannels[i].minFreq));
+    copySetting(extraChannels[i].minPulses, channel["min_pulses"], sizeof(extraChannels[i].minPulses));
+    copySetting(extraChannels[i].window, channel["window"], sizeof(extraChannels[i].window));
+    copySetting(extraChannels[i].gap, channel["gap"], sizeof(extraChannels[i].gap));
+  }
+}
+
+//Copy a json setting that may be missing
+void copySetting(char *setting, const char *value, size_t size) {
+  strlcpy(setting, value != NULL ? value : "", size);
+}
+
+//Settings of the extra channels for the configuration page
+String channelSettingsHtml() {
+  String html;
+  for (int i = 0; i < MAX_CHANNELS - 1; i++) {
+    String prefix = "ch" + String(i + 2) + "_";
+    html += "<br />input " + String(i + 2) + " (GPIO 0 active low, 13, or 15 active high; leave the pin empty when not used)<br />";
+    html += "pin: <input type='text' name='" + prefix + "pin' value='" + extraChannels[i].pin + "'><br />";
+    html += "type (bell or contact): <input type='text' name='" + prefix + "type' value='" + extraChannels[i].type + "'><br />";
+    html += "active (low or high): <input type='text' name='" + prefix + "active' value='" + extraChannels[i].active + "'><br />";
+    html += "mqtt topic: <input type='text' name='" + prefix + "topic' value='" + extraChannels[i].topic + "'><br />";
+    html += "Domiticz idx: <input type='text' name='" + prefix + "idx' value='" + extraChannels[i].idx + "'><br />";
+    html += "OpenHAB itemId: <input type='text' name='" + prefix + "item' value='" + extraChannels[i].item + "'><br />";
+    html += "ring detector, empty is the doorbell setting:<br />";
+    html += "minimum frequency (Hz): <input type='text' name='" + prefix + "min_freq' value='" + extraChannels[i].minFreq + "'><br />";
+    html += "minimum pulses: <input type='text' name='" + prefix + "min_pulses' value='" + extraChannels[i].minPulses + "'><br />";
+    html += "window (ms): <input type='text' name='" + prefix + "window' value='" + extraChannels[i].window + "'><br />";
+    html += "gap (ms): <input type='text' name='" + prefix + "gap' value='" + extraChannels[i].gap + "'><br />";
+  }
+  return html;
+}
+
+//true when any channel publishes to mqtt, the connection is only kept up then
+bool mqttConfigured() {
+  for (int c = 0; c < channelCount; c++) {
+    if (channelBackendEnabled(c, BACKEND_MQTT)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//Worst case time from the first pulse of a ring to its detection, with the interrupt latency
+ICACHE_RAM_ATTR static inline uint32_t detectionBoundUs(const RingDetector &detector) {
+  return detector.windowUs + 2 * SAMPLE_PERIOD_US;
+}
+
+//Queue a ring detector result for loop(), called from the sample timer interrupt
+ICACHE_RAM_ATTR void queueRing(uint8_t channel, ringEvent event) {
+  if (event == RING_NONE) {
+    return;
+  }
+  uint8_t head = ringHead;
+  uint8_t next = (head + 1) & (RING_QUEUE_SIZE - 1);
+  if (next == ringTail) {
+    return;
+  }
+  RingDetector &detector = channels[channel].detector;
+  ringQueue[head].event = event;
+  ringQueue[head].channel = channel;
+  ringQueue[head].startUs = detector.startUs;
+  ringQueue[head].endUs = detector.endUs;
+  ringHead = next;
+
+  if (event == RING_STARTED) {
+    uint32_t detectUs = micros() - detector.startUs;
+    if (detectUs > maxDetectUs) {
+      maxDetectUs = detectUs;
+    }
+    if (detectUs > detectionBoundUs(detector)) {
+      detectBoundMisses++;
+    }
+  }
+}
+
+//Take the oldest detected ring from the queue, returns false when it is empty
+bool popRing(ringRecord &ring) {
+  uint8_t tail = ringTail;
+  if (tail == ringHead) {
+    return false;
+  }
+  ring.event = ringQueue[tail].event;
+  ring.channel = ringQueue[tail].channel;
+  ring.startUs = ringQueue[tail].startUs;
+  ring.endUs = ringQueue[tail].endUs;
+  ringTail = (tail + 1) & (RING_QUEUE_SIZE - 1);
+  return true;
+}
+
+//Level of a channel input as the ring detector sees it, LOW is active
+ICACHE_RAM_ATTR static inline int channelLevel(const inputChannel &ch, uint32_t pins) {
+  return ((pins >> ch.pin) & 1) ^ ch.activeHigh;
+}
+
+//Sample timer interrupt: shift the inputs into their histories and run the ring detectors,
+//one pass over the channel table for the sample and for every captured edge
+ICACHE_RAM_ATTR void sampleInputs() {
+  uint32_t in = GPI;
+  uint8_t count = channelCount;
+  resetHistory = (resetHistory << 1) | (((in >> 12) & 1) ^ 1);
+
+  for (uint8_t c = 0; c < count; c++) {
+    channels[c].history = (channels[c].history << 1) | (channelLevel(channels[c], in) == LOW);
+  }
+
+  edgeEvent edge;
+  while (popEdge(edge)) {
+    for (uint8_t c = 0; c < count; c++) {
+      queueRing(c, channels[c].detector.edge(edge.us, channelLevel(channels[c], edge.pins)));
+    }
+  }
+  uint32_t nowUs = micros();
+  for (uint8_t c = 0; c < count; c++) {
+    bool active = historyActive(channels[c].history, LEVEL_FILTER_SAMPLES) * 2 > LEVEL_FILTER_SAMPLES;
+    queueRing(c, channels[c].detector.poll(nowUs, active ? LOW : HIGH));
+  }
+}
+
+void startSampler() {
+  timer1_attachInterrupt(sampleInputs);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
+  timer1_write(80000000 / 16 / SAMPLE_RATE_HZ);
+}
+
+//Debounced state of the reset button
+bool resetPressed() {
+  return historyStableActive(resetHistory, RESET_DEBOUNCE_SAMPLES);
+}
+
+bool resetReleased() {
+  return historyStableIdle(resetHistory, RESET_DEBOUNCE_SAMPLES);
+}
+
+//Interrupt handler for all channel pins, keep it short and in IRAM
+ICACHE_RAM_ATTR void inputInterrupt() {
+  if (idleSleeping) {
+    wakeUp();
+  }
+  uint8_t head = edgeHead;
+  uint8_t next = (head + 1) & (EDGE_BUFFER_SIZE - 1);
+  if (next == edgeTail) {
+    edgeOverflows++;
+    return;
+  }
+  edgeBuffer[head].us = micros();
+  edgeBuffer[head].pins = GPI & 0xFFFF;
+  edgeHead = next;
+}
+
+//Take the oldest captured edge from the ring buffer, returns false when it is empty
+ICACHE_RAM_ATTR bool popEdge(edgeEvent &edge) {
+  uint8_t tail = edgeTail;
+  if (tail == edgeHead) {
+    return false;
+  }
+  edge.us = edgeBuffer[tail].us;
+  edge.pins = edgeBuffer[tail].pins;
+  edgeTail = (tail + 1) & (EDGE_BUFFER_SIZE - 1);
+  return true;
+}
+
+
+//Reset button handling, called every loop. Does not block so the doorbell keeps working:
+//a short press starts the online AP, keeping it pressed for 5 seconds erases all settings.
+#define RESET_HOLD_TIME 5000
+enum { RESET_IDLE, RESET_HELD, RESET_START_AP };
+int resetButton = RESET_IDLE;
+unsigned long resetPressedMillis = 0;
+unsigned long apAttemptMillis = 0;
+
+void resetstate (){
+  resetState = resetPressed() ? LOW : HIGH;
+
+  switch (resetButton) {
+    case RESET_IDLE:
+      if (resetState == LOW){
+        Serial.println("It seems someone wants to go for a reset...");
+        resetButton = RESET_HELD;
+        resetPressedMillis = millis();
+
+        display.clear();
+        display.setTextAlignment(TEXT_ALIGN_LEFT);
+        display.setFont(ArialMT_Plain_10);
+        display.drawString(0, 0, "Doorbell modernizr");
+        display.drawString(0, 20, "Keep reset button pressed");
+        display.drawString(0, 30, "for 5 seconds to reset");
+        display.drawString(0, 40, "and erase all settings");
+        display.display();
+      }
+      break;
+
+    case RESET_HELD:
+      //Flash the led while the button is held
+      digitalWrite(BUILTIN_LED, ((millis() - resetPressedMillis) / 100) % 2 == 0 ? HIGH : LOW);
+
+      if (millis() - resetPressedMillis >= RESET_HOLD_TIME) {
+        //They still want to go for it
+        Serial.println("Let's do it");
+        SPIFFS.format();
+        wifiManager.resetSettings();
+        delay(500);
+        ESP.restart();
+      } else if (resetReleased()) {
+        digitalWrite(BUILTIN_LED, LOW);
+        drawDefaultScreen();
+        Serial.println("They chickened out...");
+        Serial.println("Now starting AP");
+        resetButton = RESET_START_AP;
+        apAttemptMillis = millis() - 1000;
+      }
+      break;
+
+    case RESET_START_AP:
+      //retry once a second until the AP is up
+      if (millis() - apAttemptMillis >= 1000) {
+        apAttemptMillis = millis();
         Serial.println("Attempting to start AP");
-        result = WiFi.softAP("Doorbell modernizr online" );  
+        if (WiFi.softAP("Doorbell modernizr online" )) {
+          dnsServer.start(53, "*", WiFi.softAPIP());
+
+          apstarted = true;
+          previousMillis =  millis();
+          Serial.println("AP IP address: " +  WiFi.softAPIP().toString());
+          resetButton = RESET_IDLE;
+        }
+      }
+      break;
+  }
+}
+
+//true while the reset button is being held, its screen should stay up
+bool resetHeld() {
+  return resetButton == RESET_HELD;
+}
+
+//Add the json payload of an event message: a classified press, or a ring or press sent again
+//from the outbox with its original sequence number and time
+void formatEvent(const notifyMessage &message, TextBuffer &text) {
+  const outboxEntry &entry = message.entry;
+  text.addf("{\"type\":\"%s\",\"count\":%u,\"duration\":%u",
+            entry.kind == OUTBOX_RING ? "ring" : pressTypeName(entry.detail), entry.count, entry.durationMs);
+  if (message.replay) {
+    text.addf(",\"seq\":%lu,\"boot\":%u,\"uptime\":%lu",
+              (unsigned long)entry.seq, entry.boot, (unsigned long)entry.uptimeMs);
+    //the age is only known for events of this boot
+    if (entry.boot == journal.boot) {
+      text.addf(",\"age\":%lu", (unsigned long)(millis() - entry.uptimeMs));
+    }
+  }
+  text.add("}");
+}
+
+//Add the Domoticz log message of an event message
+void formatEventLogMessage(const notifyMessage &message, TextBuffer &text) {
+  const outboxEntry &entry = message.entry;
+  text.addf("Doorbell%%20%d%%20", entry.channel + 1);
+  if (message.replay) {
+    text.add("missed%20");
+  }
+  if (entry.kind == OUTBOX_RING) {
+    text.add("ring");
+  } else {
+    text.add(pressTypeName(entry.detail)).add("%20press");
+  }
+  if (message.replay) {
+    text.add("%20seq%20").addNumber(entry.seq);
+  } else {
+    text.addf("%%20%ux%%20%ums", entry.count, entry.durationMs);
+  }
+}
+
+//true for a plain 'on' or 'off' state message, false for an event message
+bool stateMessage(const notifyMessage &message) {
+  return message.entry.kind == OUTBOX_OFF || (message.entry.kind == OUTBOX_RING && !message.replay);
+}
+
+//true when the notifications are published with QoS 1
+bool mqttQos1() {
+  return strcmp(mqtt_qos, "1") == 0;
+}
+
+//true when a ring of the channel goes to mqtt as one message instead of 'on' and 'off'. A contact
+//channel always sends both, its hold time is only known when it ends.
+bool ringEvents(int c) {
+  return strcmp(mqtt_mode, "event") == 0 && channels[c].type == CHANNEL_BELL;
+}
+
+//Add the json payload of a ring in event mode, the consumer turns it off after the hold time
+void formatRingEvent(const notifyMessage &message, TextBuffer &text) {
+  const outboxEntry &entry = message.entry;
+  text.addf("{\"type\":\"ring\",\"seq\":%lu,\"boot\":%u,\"uptime\":%lu,\"hold\":%u}",
+            (unsigned long)entry.seq, entry.boot, (unsigned long)entry.uptimeMs, HOLD_TIME);
+}
+
+//A PUBACK came in on the mqtt connection
+void mqttAcked(uint16_t packetId) {
+  mqttPublisher.ack(packetId);
+}
+
+//Publish the retained state of a topic. With QoS 1 it is not tracked and it falls back to QoS 0
+//when the slots it may use are taken, the others are kept for the notifications.
+void publishState(const char *topic, const char *state) {
+  if (!mqttQos1() || mqttPublisher.publish(topic, state, true, false) == 0) {
+    client.publish(topic, state, true);
+  }
+}
+
+//Home assistant: 'on'/'off' on <topic>, events on <topic>/event. The mqtt connection is kept up by loop(),
+//a publish is written right away. With QoS 1 the message is delivered once the broker acknowledged it,
+//mqttPublisher sends it again meanwhile when needed. The queue does not wait for the PUBACK: the
+//message is kept here and settle() reports its result.
+class MqttBackend : public NotifyBackend {
+ public:
+  void begin(notifyMessage &message) override {
+    message.trace.dispatchUs = micros();
+    const inputChannel &ch = channels[message.entry.channel];
+    payload.clear();
+    retained = stateMessage(message);
+    if (retained && message.entry.kind == OUTBOX_RING && ringEvents(message.entry.channel)) {
+      Serial.print("Doorbell is pressed!, sending ring event to ");
+      Serial.print(mqtt_server);
+      Serial.print(" with topic ");
+      Serial.println(ch.topic);
+      topic = ch.topic;
+      retained = false;  //nothing is left behind when the device resets during the hold
+      formatRingEvent(message, payload);
+    } else if (retained) {
+      bool on = message.entry.kind == OUTBOX_RING;
+      Serial.print(on ? "Doorbell is pressed!, sending 'on' message to " : "sending 'off' message to ");
+      Serial.print(mqtt_server);
+      Serial.print(" on port ");
+      Serial.print(mqtt_port);
+      Serial.print(" with topic ");
+      Serial.println(ch.topic);
+      topic = ch.topic;
+      payload.add(on ? "on" : "off");
+    } else {
+      topic = ch.requests.mqttEventTopic.c_str();
+      formatEvent(message, payload);
+    }
+  }
+
+  uint8_t poll(notifyMessage &message) override {
+    if (payload.overflowed() || !client.connected()) {
+      return DISPATCH_FAILED;
+    }
+    if (!mqttQos1()) {
+      if (!client.publish(topic, payload.c_str(), retained)) {
+        return DISPATCH_FAILED;
+      }
+      written(message);
+      return DISPATCH_OK;
+    }
+    if (!mqttPublisher.available(true)) {
+      return DISPATCH_BUSY;  //a slot frees up within MQTT_ACK_TIMEOUT
+    }
+    uint16_t packetId = mqttPublisher.publish(topic, payload.c_str(), retained, true);
+    if (packetId == 0) {
+      return DISPATCH_FAILED;
+    }
+    written(message);
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      if (awaiting[i].packetId == 0) {
+        awaiting[i].packetId = packetId;
+        awaiting[i].message = message;
+        break;
+      }
+    }
+    return DISPATCH_SENT;
+  }
+
+  //report the results of the publishes that were acknowledged or given up, call from loop()
+  void settle() {
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      awaitingAck &a = awaiting[i];
+      uint32_t ackUs;
+      if (a.packetId == 0) {
+        continue;
+      }
+      uint8_t state = mqttPublisher.take(a.packetId, ackUs);
+      if (state == MQTT_PENDING) {
+        continue;
       }
-      
-      if(result == true)
-      {
-        dnsServer.start(53, "*", WiFi.softAPIP());
-          
-        apstarted = true;
-        previousMillis =  millis();
-        Serial.println("AP IP address: " +  WiFi.softAPIP().toString());
+      a.packetId = 0;
+      if (state == MQTT_ACKED) {
+        a.message.trace.responseUs = ackUs;
+        messageCompleted(BACKEND_MQTT, a.message, DISPATCH_OK);
+      } else {
+        Serial.println("mqtt message not acknowledged");
+        messageCompleted(BACKEND_MQTT, a.message, DISPATCH_FAILED);
       }
     }
   }
+
+ private:
+  //a tracked publish holds a publisher slot until it is taken, so there is always room here
+  struct awaitingAck {
+    uint16_t packetId;  //0 when free
+    notifyMessage message;
+  };
+
+  void written(notifyMessage &message) {
+    message.trace.connectUs = message.trace.dispatchUs;  //the connection is already up
+    message.trace.writtenUs = micros();
+  }
+
+  const char *topic = "";
+  FixedText<160> payload;
+  bool retained = false;
+  awaitingAck awaiting[MQTT_INFLIGHT_SIZE] = {};
+};
+
+//Domoticz: 'on'/'off' through udevice on the idx, events as a log message
+class DomoticzBackend : public HttpBackend {
+ protected:
+  const char* host() override { return mqtt_server; }
+  uint16_t port() override { return atoi(mqtt_port); }
+
+  //Domoticz answers 200 also when it refuses a command, the json status tells
+  bool accepted(const HttpResponse &response) override {
+    if (!HttpBackend::accepted(response)) {
+      return false;
+    }
+    if (strcmp(response.jsonStatus, "OK") != 0) {
+      Serial.print("Domoticz status: ");
+      Serial.println(response.jsonStatus);
+      return false;
+    }
+    return true;
+  }
+
+  void buildRequest(const notifyMessage &message, TextBuffer &request) override {
+    if (stateMessage(message)) {
+      bool on = message.entry.kind == OUTBOX_RING;
+      Serial.println(on ? "sending 'on' message to Domiticz" : "sending 'off' message to Domiticz");
+      request.add(channels[message.entry.channel].requests.domoticzState).add(on ? "1" : "0");
+    } else {
+      request.add("GET /json.htm?type=command&param=addlogmessage&message=");
+      formatEventLogMessage(message, request);
+    }
+    request.add(domoticzTail);
+  }
+};
+
+//OpenHAB: 'ON'/'OFF' to the item, events to the String item <itemId>_event when oh_events is on
+class OpenhabBackend : public HttpBackend {
+ protected:
+  const char* host() override { return mqtt_server; }
+  uint16_t port() override { return atoi(mqtt_port); }
+
+  void buildRequest(const notifyMessage &message, TextBuffer &request) override {
+    request.add(channels[message.entry.channel].requests.openhabItem);
+    if (stateMessage(message)) {
+      bool on = message.entry.kind == OUTBOX_RING;
+      Serial.println(on ? "sending 'ON' message to openHAB" : "sending 'OFF' message to openHAB");
+      request.add(openhabHeaders).add(on ? "2\r\n\r\nON" : "3\r\n\r\nOFF");
+      return;
+    }
+    //the body is formatted first, its length goes in the headers
+    eventBody.clear();
+    formatEvent(message, eventBody);
+    request.add("_event").add(openhabHeaders).addNumber(eventBody.length()).add("\r\n\r\n").add(eventBody);
+  }
+
+ private:
+  FixedText<160> eventBody;
+};
+
+//Webhook: any http endpoint, like Node-RED. The request is rendered from the configured templates,
+//for the 'on'/'off' states as well as the events.
+class WebhookBackend : public HttpBackend {
+ protected:
+  const char* host() override { return webhook_host; }
+  uint16_t port() override { return atoi(webhook_port); }
+
+  void buildRequest(const notifyMessage &message, TextBuffer &request) override {
+    const outboxEntry &entry = message.entry;
+    bool state = stateMessage(message);
+    templateValues values = {
+      entry.kind == OUTBOX_OFF ? "off" : entry.kind == OUTBOX_RING ? "ring" : pressTypeName(entry.detail),
+      !state ? "" : entry.kind == OUTBOX_RING ? "on" : "off",
+      entry.channel + 1u, entry.count, entry.durationMs, entry.seq, entry.boot, entry.uptimeMs, message.replay
+    };
+    if (state) {
+      Serial.println(entry.kind == OUTBOX_RING ? "sending 'on' message to the webhook" : "sending 'off' message to the webhook");
+    }
+
+    body.clear();
+    webhookBody.render(body, values);
+    request.add(webhook_method).add(" ");
+    webhookPath.render(request, values);
+    request.add(webhookHead);
+    webhookHeaders.render(request, values);
+    if (body.length() != 0 || strcmp(webhook_method, "GET") != 0) {
+      request.add("Content-Length: ").addNumber(body.length()).add("\r\n");
+    }
+    request.add("\r\n").add(body);
+  }
+
+ private:
+  FixedText<256> body;
+};
+
+MqttBackend mqttBackend;
+DomoticzBackend domoticzBackend;
+OpenhabBackend openhabBackend;
+WebhookBackend webhookBackend;
+Dispatcher dispatcher(messageCompleted);
+
+//Register the backends with the dispatcher, in the order of the BACKEND_ numbers
+void setupDispatcher() {
+  dispatcher.add(&mqttBackend);
+  dispatcher.add(&domoticzBackend);
+  dispatcher.add(&openhabBackend);
+  dispatcher.add(&webhookBackend);
+}
+
+//Apply the tcp settings to the backend connections, they take effect on the next connect
+//true when mqtt runs over tls
+bool mqttSecure() {
+  return TLS_SUPPORT && mqtt_fingerprint[0] != 0;
+}
+
+//The socket mqtt runs over, tls when the broker fingerprint is set
+WiFiClient& mqttSocket() {
+#if TLS_SUPPORT
+  if (mqttSecure()) {
+    return mqttTls;
+  }
+#endif
+  return espClient;
+}
+
+void setupConnections() {
+  bool noDelay = strcmp(tcp_nodelay, "on") == 0;
+  domoticzBackend.connection.noDelay = noDelay;
+  openhabBackend.connection.noDelay = noDelay;
+  webhookBackend.connection.noDelay = noDelay;
+  domoticzBackend.connection.resolver = &dnsCache;
+  openhabBackend.connection.resolver = &dnsCache;
+  webhookBackend.connection.resolver = &dnsCache;
+  dnsCache.clear();
+#if TLS_SUPPORT
+  if (mqttSecure() && !mqttTls.configure(mqtt_fingerprint)) {
+    Serial.println("invalid mqtt fingerprint");
+  }
+  mqttTls.setTimeout(TLS_CONNECT_TIMEOUT);
+#else
+  if (mqtt_fingerprint[0] != 0) {
+    Serial.println("built without TLS_SUPPORT, the mqtt fingerprint is ignored");
+  }
+#endif
+  mqttTransport.use(mqttSocket());
+  espClient.setTimeout(CONNECT_TIMEOUT);
+  client.setSocketTimeout((mqttSecure() ? TLS_CONNECT_TIMEOUT : CONNECT_TIMEOUT) / 1000);
+  if (!domoticzBackend.connection.secureWith(http_fingerprint) || !openhabBackend.connection.secureWith(http_fingerprint)) {
+    Serial.println(TLS_SUPPORT ? "invalid http fingerprint" : "built without TLS_SUPPORT, the http fingerprint is ignored");
+  }
+  if (!webhookBackend.connection.secureWith(webhook_fingerprint)) {
+    Serial.println(TLS_SUPPORT ? "invalid webhook fingerprint" : "built without TLS_SUPPORT, the webhook fingerprint is ignored");
+  }
+  if (!udpNotifier.configure(udp_targets, atoi(udp_port), atoi(udp_copies))) {
+    Serial.println("invalid udp targets, only the addresses before the wrong one are used");
+  }
+}
+
+//A message of a channel to one backend
+notifyMessage channelMessage(int backend, uint8_t kind, int c, uint32_t seq, uint8_t detail, uint8_t count, uint16_t durationMs, uint32_t edgeUs) {
+  return {{seq, (uint32_t)millis(), journal.boot, durationMs, kind, (uint8_t)c, (uint8_t)backend, detail, count, {0, 0, 0}},
+          false, {edgeUs, 0, 0, 0, 0}};
+}
+
+//Messages of an event that did not fit in their dispatch queue. They fail after the journal
+//record of the event is written, so the failure is in the journal and the message in the outbox.
+struct overflowedMessages {
+  notifyMessage messages[BACKEND_COUNT];
+  uint8_t count = 0;
+
+  //send a message, the result comes back in messageCompleted()
+  void send(int backend, const notifyMessage &message) {
+    if (!dispatcher.dispatch(backend, message)) {
+      messages[count++] = message;
+    }
+  }
+
+  void fail() {
+    for (uint8_t i = 0; i < count; i++) {
+      messageCompleted(messages[i].entry.backend, messages[i], DISPATCH_FAILED);
+    }
+  }
+};
+
+//Send a classified press to every backend, next to the plain on/off state:
+//mqtt on <topic>/event, Domoticz as a log message and, when openHAB events are on, openHAB to the
+//String item <itemId>_event
+void sendPressEvent(int c, const pressEvent &press) {
+  Serial.print("Doorbell press event on input ");
+  Serial.print(c + 1);
+  Serial.print(": ");
+  Serial.print(pressTypeName(press.type));
+  Serial.print(" ");
+  Serial.print(press.count);
+  Serial.print("x ");
+  Serial.print(press.durationMs);
+  Serial.println(" ms");
+
+  //the journal record is written right after the messages are started, the results are filled in later
+  uint32_t seq = journal.nextSeq;
+  uint16_t durationMs = std::min(press.durationMs, (uint32_t)JOURNAL_NO_DURATION - 1);
+  udpNotifier.notify({UDP_PRESS, (uint8_t)c, press.type, press.count, seq, journal.boot, durationMs, (uint32_t)millis(), 0});
+  uint8_t deliveries = 0xFF;
+  overflowedMessages overflowed;
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    if (!channelEventsEnabled(c, backend)) {
+      continue;
+    }
+    if (!backendAllowed(backend)) {
+      deliveries = FlashJournal::withDelivery(deliveries, backend, DELIVERY_DROPPED);
+      continue;
+    }
+    overflowed.send(backend, channelMessage(backend, OUTBOX_PRESS, c, seq, press.type, press.count, durationMs, 0));
+  }
+  journal.append(JOURNAL_PRESS, c, press.type, durationMs, deliveries);
+  overflowed.fail();
+}
+
+//false while the backend cannot be reached, its outbox is not replayed then
+bool backendReachable(int backend) {
+  switch (backend) {
+    case BACKEND_MQTT:     return client.connected();
+    case BACKEND_DOMOTICZ: return domoticzBackend.connection.reachable();
+    case BACKEND_OPENHAB:  return openhabBackend.connection.reachable();
+    case BACKEND_WEBHOOK:  return webhookBackend.connection.reachable();
+  }
+  return false;
+}
+
+//true when press events of the channel go to the backend, next to the on/off state
+bool channelEventsEnabled(int c, int backend) {
+  return channelBackendEnabled(c, backend) && (backend != BACKEND_OPENHAB || strcmp(oh_events, "on") == 0);
+}
+
+//true when a queued message can be sent again: rings and presses are replayed as events
+bool replayable(const outboxEntry &entry) {
+  return entry.kind == OUTBOX_OFF ? channelBackendEnabled(entry.channel, entry.backend)
+                                  : channelEventsEnabled(entry.channel, entry.backend);
+}
+
+bool channelBackendEnabled(int c, int backend) {
+  switch (backend) {
+    case BACKEND_MQTT:     return strlen(channels[c].topic) != 0;
+    case BACKEND_DOMOTICZ: return strlen(channels[c].idx) != 0;
+    case BACKEND_OPENHAB:  return strlen(channels[c].item) != 0;
+    case BACKEND_WEBHOOK:  return webhookEnabled;
+  }
+  return false;
+}
+
+//Send the 'off' message of a channel
+void sendOff(int c, int backend) {
+  notifyMessage message = channelMessage(backend, OUTBOX_OFF, c, channels[c].journalSeq, 0, 0, 0, 0);
+  if (!dispatcher.dispatch(backend, message)) {
+    messageCompleted(backend, message, DISPATCH_FAILED);
+  }
+}
+
+//A message is delivered or has failed: update the journal and the latency, queue a failed message
+//in the outbox, or take a replayed one out of it. A rejected message is not sent again.
+void messageCompleted(uint8_t backend, const notifyMessage &message, uint8_t result) {
+  const outboxEntry &entry = message.entry;
+  bool delivered = result == DISPATCH_OK;
+  if (message.replay) {
+    if (result == DISPATCH_REJECTED) {
+      outbox.removeMessage(entry);
+      return;
+    }
+    if (!delivered) {
+      replaying[backend] = false;  //try again after OUTBOX_RETRY_INTERVAL
+      return;
+    }
+    outbox.removeMessage(entry);
+    if (entry.kind != OUTBOX_OFF) {
+      journal.setDelivery(entry.seq, backend, DELIVERY_OK);
+    }
+    return;
+  }
+
+  if (entry.kind != OUTBOX_OFF) {
+    journal.setDelivery(entry.seq, backend, delivered ? DELIVERY_OK : DELIVERY_FAILED);
+  }
+  if (message.trace.edgeUs != 0) {
+    recordLatency(backend, message.trace);
+    if (delivered && wakeUs != 0) {
+      wakeLatency.add(micros() - wakeUs);
+      wakeUs = 0;
+    }
+  }
+  if (!delivered) {
+    if (backend == BACKEND_MQTT && !client.connected() && dispatcher.idleExcept(BACKEND_MQTT)) {
+      mqttBackoff.expedite();
+    }
+    if (result == DISPATCH_REJECTED || !replayable(entry)) {
+      return;
+    }
+    outbox.push(entry);
+    Serial.print("queued undelivered message for ");
+    Serial.print(backendName(backend));
+    Serial.print(", queue size ");
+    Serial.println(outbox.size());
+  }
+}
+
+//Send the next queued message of a backend again, a ring or press as an event with its original
+//sequence number and time. Stops when the outbox of the backend is empty.
+void replayNext(int backend) {
+  while (true) {
+    int i = outbox.first(backend);
+    if (i < 0) {
+      replaying[backend] = false;
+      return;
+    }
+    const outboxEntry &entry = outbox.data.entries[i];
+    //the channel may be gone after a configuration change
+    if (entry.channel < channelCount && replayable(entry)) {
+      Serial.print("replaying message ");
+      Serial.print(entry.seq);
+      Serial.print(" to ");
+      Serial.println(backendName(backend));
+      if (!dispatcher.dispatch(backend, {entry, true, {0, 0, 0, 0, 0}})) {
+        replaying[backend] = false;  //try again after OUTBOX_RETRY_INTERVAL
+      }
+      return;
+    }
+    outbox.remove(i);
+  }
+}
+
+//Add the name of a channel for the display
+void formatChannelName(int c, TextBuffer &text) {
+  if (c == 0) {
+    text.add("Doorbell");
+  } else {
+    text.add(channels[c].type == CHANNEL_CONTACT ? "Contact " : "Doorbell ").addNumber(c + 1);
+  }
+}
+
+//A ring has been detected: send 'on' to every backend of the channel and, for a bell,
+//schedule its 'off'. A ring while the previous one is still held is sent again and restarts the hold.
+void startRing(int c, uint32_t startUs) {
+  uint32_t freeHeap = dispatcher.allocCheck.start();
+  inputChannel &ch = channels[c];
+  ch.ringsInHold++;
+  FixedText<32> name;
+  formatChannelName(c, name);
+  Serial.print(name.c_str());
+  Serial.print(" ring detected, first pulse ");
+  Serial.print(micros() - startUs);
+  Serial.print(" us ago, longest detection time ");
+  Serial.print(maxDetectUs);
+  Serial.print(" us (bound ");
+  Serial.print(detectionBoundUs(ch.detector));
+  Serial.print(" us, exceeded ");
+  Serial.print(detectBoundMisses);
+  Serial.println(" times)");
+  if (ch.ringsInHold > 1) {
+    Serial.print("Doorbell rang again while holding, rings: ");
+    Serial.println(ch.ringsInHold);
+  }
+  dispatcher.allocCheck.stop(freeHeap, "logging a ring");
+
+  //the lan datagram goes first, it needs no connection
+  ch.journalSeq = journal.nextSeq;
+  udpNotifier.notify({UDP_RING, (uint8_t)c, 0, 1, ch.journalSeq, journal.boot, 0, (uint32_t)millis(), startUs});
+
+  //start the 'on' message on every backend at once, the results are filled in the journal later
+  uint8_t deliveries = 0xFF;
+  overflowedMessages overflowed;
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    if (!channelBackendEnabled(c, backend)) {
+      continue;
+    }
+    if (!backendAllowed(backend)) {
+      deliveries = FlashJournal::withDelivery(deliveries, backend, DELIVERY_DROPPED);
+      continue;
+    }
+    overflowed.send(backend, channelMessage(backend, OUTBOX_RING, c, ch.journalSeq, 0, 1, 0, startUs));
+    if (ch.type == CHANNEL_BELL && !(backend == BACKEND_MQTT && ringEvents(c))) {
+      ch.offPending[backend] = true;
+      ch.offDueMillis[backend] = millis() + HOLD_TIME;
+    }
+  }
+
+  //the display after sending, writing it takes a few ms
+  freeHeap = dispatcher.allocCheck.start();
+  FixedText<48> line;
+  display.clear();
+  display.setTextAlignment(TEXT_ALIGN_LEFT);
+  display.setFont(ArialMT_Plain_10);
+  display.drawString(0, 0, "Doorbell modernizr");
+  line.add(name).add(" is pressed");
+  if (ch.ringsInHold > 1) {
+    line.add(" (").addNumber(ch.ringsInHold).add("x)");
+  }
+  display.drawString(0, 20, line.c_str());
+  display.drawString(0, 30, "sending 'on' message to");
+  line.clear();
+  line.add(mqtt_server).add(" on port ").add(mqtt_port);
+  display.drawString(0, 40, line.c_str());
+  line.clear();
+  line.add("with topic ").add(ch.topic);
+  display.drawString(0, 50, line.c_str());
+  display.display();
+  dispatcher.allocCheck.stop(freeHeap, "drawing a ring");
+
+  //journal after sending, a sector erase must not delay the 'on' message
+  freeHeap = dispatcher.allocCheck.start();
+  journal.append(JOURNAL_RING, c, 0, JOURNAL_NO_DURATION, deliveries);
+  dispatcher.allocCheck.stop(freeHeap, "journaling a ring");
+  overflowed.fail();
+}
+
+//A contact channel became inactive, send 'off' to every backend of the channel
+void endContact(int c) {
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    if (channelBackendEnabled(c, backend)) {
+      sendOff(c, backend);
+    }
+  }
+  channels[c].ringsInHold = 0;
+}
+
+//Put the stages of a traced message into the histograms of the backend
+void recordLatency(int backend, const latencyTrace &trace) {
+  latency[backend][STAGE_DISPATCH].add(trace.dispatchUs - trace.edgeUs);
+  uint32_t previousUs = trace.dispatchUs;
+  if (trace.connectUs != 0) {
+    latency[backend][STAGE_CONNECT].add(trace.connectUs - previousUs);
+    previousUs = trace.connectUs;
+  }
+  if (trace.writtenUs != 0) {
+    latency[backend][STAGE_WRITE].add(trace.writtenUs - previousUs);
+    previousUs = trace.writtenUs;
+  }
+  if (trace.responseUs != 0) {
+    latency[backend][STAGE_RESPONSE].add(trace.responseUs - previousUs);
+    previousUs = trace.responseUs;
+  }
+  //only delivered messages count for the total
+  if (trace.writtenUs != 0 || trace.responseUs != 0) {
+    latency[backend][STAGE_TOTAL].add(previousUs - trace.edgeUs);
+  }
+}
+
+const char* backendName(int backend) {
+  switch (backend) {
+    case BACKEND_MQTT:     return "mqtt";
+    case BACKEND_DOMOTICZ: return "domoticz";
+    case BACKEND_OPENHAB:  return "openhab";
+    case BACKEND_WEBHOOK:  return "webhook";
+  }
+  return "unknown";
+}
+
+const char* stageName(int stage) {
+  switch (stage) {
+    case STAGE_DISPATCH: return "dispatch";
+    case STAGE_CONNECT:  return "connect";
+    case STAGE_WRITE:    return "write";
+    case STAGE_RESPONSE: return "response";
+    case STAGE_TOTAL:    return "total";
+  }
+  return "unknown";
+}
+
+//Handle webserver metrics request, the latency histograms of every backend as json
+void handleMetrics() {
+  char buf[160];
+  String metrics = "{\"latency\":{";
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    metrics += String(backend == 0 ? "\"" : ",\"") + backendName(backend) + "\":{";
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+      latency[backend][stage].format(buf, sizeof(buf));
+      metrics += String(stage == 0 ? "\"" : ",\"") + stageName(stage) + "\":" + buf;
+    }
+    metrics += "}";
+  }
+  wakeLatency.format(buf, sizeof(buf));
+  metrics += "},\"sleep\":{\"enabled\":" + String(strcmp(idle_sleep, "on") == 0 ? "true" : "false") +
+             ",\"count\":" + String(sleepCount) + ",\"wait_ms\":" + String(idleWaitMillis) +
+             ",\"uptime\":" + String(millis()) + ",\"wake_to_publish\":" + buf + "}";
+  domoticzBackend.connection.format(buf, sizeof(buf));
+  metrics += String(",\"connections\":{\"domoticz\":") + buf;
+  openhabBackend.connection.format(buf, sizeof(buf));
+  metrics += String(",\"openhab\":") + buf;
+  webhookBackend.connection.format(buf, sizeof(buf));
+  metrics += String(",\"webhook\":") + buf + "}";
+  mqttPublisher.format(buf, sizeof(buf));
+  metrics += ",\"mqtt\":{\"client_id\":\"" + String(mqtt_client_id) + "\",\"persistent\":" +
+             String(strcmp(mqtt_persistent, "on") == 0 ? "true" : "false") + ",\"connects\":" + String(mqttConnects.total) +
+             ",\"connects_last_hour\":" + String(mqttConnects.lastHour(millis())) +
+             ",\"failed_attempts\":" + String(mqttBackoff.failures) + ",\"retry_in\":" + String(client.connected() ? 0 : mqttBackoff.remainingMs(millis())) +
+             ",\"qos\":" + String(mqtt_qos) + ",\"delivery\":" + buf;
+  mqttPublisher.ackLatency.format(buf, sizeof(buf));
+  metrics += String(",\"ack\":") + buf + "}";
+  dnsCache.format(buf, sizeof(buf));
+  metrics += String(",\"dns\":{\"cache\":") + buf;
+  dnsCache.lookupLatency.format(buf, sizeof(buf));
+  metrics += String(",\"lookup\":") + buf + "}";
+  udpNotifier.format(buf, sizeof(buf));
+  metrics += String(",\"udp\":") + buf;
+  metrics += ",\"detection\":{\"max\":" + String(maxDetectUs) + ",\"bound\":" + String(detectionBoundUs(channels[0].detector)) +
+             ",\"bound_exceeded\":" + String(detectBoundMisses) + "}";
+#if TLS_SUPPORT
+  metrics += ",\"tls\":{";
+  PinnedTlsClient *tlsClients[BACKEND_COUNT] = {&mqttTls, &domoticzBackend.connection.secure, &openhabBackend.connection.secure,
+                                   &webhookBackend.connection.secure};
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    tlsClients[backend]->format(buf, sizeof(buf));
+    metrics += String(backend == 0 ? "\"" : ",\"") + backendName(backend) + "\":" + buf;
+  }
+  metrics += "}";
+#endif
+#if ALLOC_CHECK
+  metrics += ",\"ring_path_allocated\":" + String(dispatcher.allocCheck.allocatedBytes);
+#endif
+  metrics += "}";
+  server.send(200, "application/json", metrics);
+}
+
+//Find the journal sectors below SPIFFS and log the boot
+void setupJournal() {
+  uint32_t start = ((uint32_t)&_SPIFFS_start - 0x40200000) - JOURNAL_SECTORS * SPI_FLASH_SEC_SIZE;
+  uint32_t sketchEnd = (ESP.getSketchSize() + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+  if (start < sketchEnd) {
+    Serial.println("sketch too large, journal disabled");
+    return;
+  }
+  if (!journal.begin(start)) {
+    Serial.println("failed to open journal");
+    return;
+  }
+  journal.append(JOURNAL_BOOT, 0, ESP.getResetInfoPtr()->reason, 0);
+  Serial.print("journal at 0x");
+  Serial.print(start, HEX);
+  Serial.print(", boot ");
+  Serial.print(journal.boot);
+  Serial.print(", records ");
+  Serial.print(journal.firstSeq());
+  Serial.print(" - ");
+  Serial.println(journal.nextSeq);
+}
+
+//Handle webserver journal request: /journal?page=0&size=32, page 0 holds the newest records.
+//The records are streamed one by one, the response never has to fit in memory.
+void handleJournal() {
+  uint32_t size = server.hasArg("size") ? server.arg("size").toInt() : JOURNAL_PAGE_SIZE;
+  size = constrain(size, 1, JOURNAL_MAX_PAGE_SIZE);
+  uint32_t page = server.arg("page").toInt();
+  uint32_t first = journal.firstSeq();
+  uint32_t records = journal.nextSeq - first;
+
+  char buf[200];
+  snprintf(buf, sizeof(buf), "{\"enabled\":%s,\"boot\":%u,\"first\":%lu,\"next\":%lu,\"page\":%lu,\"pages\":%lu,\"erases\":[",
+           journal.enabled() ? "true" : "false", journal.boot, (unsigned long)first, (unsigned long)journal.nextSeq,
+           (unsigned long)page, (unsigned long)((records + size - 1) / size));
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", buf);
+  for (int sector = 0; sector < JOURNAL_SECTORS; sector++) {
+    snprintf(buf, sizeof(buf), sector == 0 ? "%lu" : ",%lu", (unsigned long)journal.eraseCount[sector]);
+    server.sendContent(buf);
+  }
+  server.sendContent("],\"records\":[");
+
+  bool firstRecord = true;
+  for (uint32_t i = page * size; i < (page + 1) * size && i < records; i++) {
+    journalRecord record;
+    if (!journal.read(journal.nextSeq - 1 - i, record)) {
+      continue;
+    }
+    formatJournalRecord(record, buf, sizeof(buf), firstRecord);
+    server.sendContent(buf);
+    firstRecord = false;
+  }
+  server.sendContent("]}");
+  server.sendContent("");  //end of the chunked response
+}
+
+//Format a journal record as json, the delivery result as one field per backend
+void formatJournalRecord(const journalRecord &record, char *buf, size_t len, bool first) {
+  int used = snprintf(buf, len, "%s{\"seq\":%lu,\"boot\":%u,\"uptime\":%lu,\"type\":\"%s\",\"channel\":%u,\"detail\":\"%s\"",
+                      first ? "" : ",", (unsigned long)record.seq, record.boot, (unsigned long)record.uptimeMs,
+                      journalTypeName(record.type), record.channel,
+                      record.type == JOURNAL_PRESS ? pressTypeName(record.detail) :
+                      record.type == JOURNAL_RING ? (record.detail ? "folded" : "sent") : String(record.detail).c_str());
+  if (record.durationMs != JOURNAL_NO_DURATION) {
+    used += snprintf(buf + used, len - used, ",\"duration\":%u", record.durationMs);
+  }
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    used += snprintf(buf + used, len - used, ",\"%s\":\"%s\"", backendName(backend),
+                     journalDeliveryName(FlashJournal::delivery(record, backend)));
+  }
+  snprintf(buf + used, len - used, "}");
+}
+
+//Publish the total latency of every backend on <topic>/metrics/<backend>
+void publishMetrics() {
+  char buf[100];
+  if (strlen(channels[0].topic) == 0) {
+    return;
+  }
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    if (latency[backend][STAGE_TOTAL].count == 0) {
+      continue;
+    }
+    latency[backend][STAGE_TOTAL].format(buf, sizeof(buf));
+    String topic = String(channels[0].topic) + "/metrics/" + backendName(backend);
+    //beginPublish, the message does not have to fit in MQTT_MAX_PACKET_SIZE
+    client.beginPublish(topic.c_str(), strlen(buf), false);
+    client.print(buf);
+    client.endPublish();
+  }
+}
+
+//A ring within the coalescing window of the previous one: only count it and keep holding
+void foldRing(int c) {
+  uint32_t freeHeap = dispatcher.allocCheck.start();
+  inputChannel &ch = channels[c];
+  ch.ringsInHold++;
+  //a folded ring is not sent, it is journaled with detail 1 and no delivery
+  ch.journalSeq = journal.append(JOURNAL_RING, c, 1, JOURNAL_NO_DURATION);
+  FixedText<48> line;
+  formatChannelName(c, line);
+  Serial.print(line.c_str());
+  Serial.print(" rang again, folded into the current notification, rings: ");
+  Serial.println(ch.coalescer.rings);
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    if (ch.offPending[backend]) {
+      ch.offDueMillis[backend] = millis() + HOLD_TIME;
+    }
+  }
+
+  display.clear();
+  display.setTextAlignment(TEXT_ALIGN_LEFT);
+  display.setFont(ArialMT_Plain_10);
+  display.drawString(0, 0, "Doorbell modernizr");
+  line.add(" is pressed (").addNumber(ch.coalescer.rings).add("x)");
+  display.drawString(0, 20, line.c_str());
+  display.display();
+  dispatcher.allocCheck.stop(freeHeap, "folding a ring");
+}
+
+//Check the rate limit of a backend before sending it an 'on' or event message
+bool backendAllowed(int backend) {
+  if (backendLimiter[backend].allow(millis())) {
+    return true;
+  }
+  Serial.print("Rate limit reached, not notifying backend ");
+  Serial.print(backend);
+  Serial.print(", dropped: ");
+  Serial.println(backendLimiter[backend].dropped);
+  return false;
+}
+
+//Send the scheduled 'off' messages that are due
+void serviceRing() {
+  for (int c = 0; c < channelCount; c++) {
+    inputChannel &ch = channels[c];
+    bool held = false;
+    for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+      if (ch.offPending[backend] && (long)(millis() - ch.offDueMillis[backend]) >= 0) {
+        ch.offPending[backend] = false;
+        sendOff(c, backend);
+      }
+      held = held || ch.offPending[backend];
+    }
+    if (!held && ch.type == CHANNEL_BELL) {
+      ch.ringsInHold = 0;
+    }
+  }
+}
+
+//true while an 'off' message is still waiting to be sent
+bool ringHeld() {
+  for (int c = 0; c < channelCount; c++) {
+    for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+      if (channels[c].offPending[backend]) {
+        return true;
+      }
+    }
+  }
+  return false;
 }
 
 void drawDefaultScreen(){
@@ -478,9 +2154,9 @@ void loop() {
  
   resetstate();
   
-  if (strlen(mqtt_topic) != 0){
+  if (mqttConfigured()){
        //try to reconnect to mqtt server if connection is lost
-    if (!client.connected()) { 
+    if (!client.connected() && mqttBackoff.due(millis())) {
       reconnect();
     }
     client.loop();
@@ -489,123 +2165,161 @@ void loop() {
   server.handleClient();
   dnsServer.processNextRequest();
    
-  doorbellState = digitalRead(doorbellPin);
-  resetState = digitalRead(12);
-  drawDefaultScreen();  
-    
- if ( doorbellState == LOW ) {
-    display.clear();
-    display.setTextAlignment(TEXT_ALIGN_LEFT);
-    display.setFont(ArialMT_Plain_10);
-    display.drawString(0, 0, "Doorbell modernizr");
-    display.drawString(0, 20, "Doorbell is pressed");
-    display.drawString(0, 30, "sending 'on' message to");
-    display.drawString(0, 40, String(mqtt_server) + " on port " + String(mqtt_port));
-    display.drawString(0, 50, "with topic " + String(mqtt_topic));
-    display.display();
-
-    if (strlen(mqtt_topic) != 0){
-      client.publish(mqtt_topic, "on" , true);
-      Serial.print("Doorbell is pressed!, sending 'on' message to ");
-      Serial.print(mqtt_server);
-      Serial.print(" on port ");
-      Serial.print(mqtt_port);
-      Serial.print(" with topic ");
-      Serial.println(mqtt_topic);
-      
-  
-      //wait 5 seconds, then publish the off message
-      delay( 5000 );
-  
-      display.clear();
-      display.setTextAlignment(TEXT_ALIGN_LEFT);
-      display.setFont(ArialMT_Plain_10);
-      display.drawString(0, 0, "Doorbell modernizr");
-  
-      display.drawString(0, 30, "sending 'off' message to");
-      display.drawString(0, 40, String(mqtt_server) + " on port " + String(mqtt_port));
-      display.drawString(0, 50, "with topic " + String(mqtt_topic));
-      display.display();
-      
-      Serial.print("sending 'off' message to ");
-      Serial.print(mqtt_server);
-      Serial.print(" on port ");
-      Serial.print(mqtt_port);
-      Serial.print(" with topic ");
-      Serial.println(mqtt_topic);
-      client.publish(mqtt_topic, "off" , true);    
-    }
-   if (strlen(dz_idx) != 0){
-    if (espClient.connect(mqtt_server,atoi(mqtt_port))){
-      Serial.println("sending 'on' message to Domiticz");
-      espClient.print("GET /json.htm?type=command&param=udevice&idx=");
-      espClient.print(String(dz_idx));
-      espClient.print("&nvalue=1");
-      
-      if (strlen(mqtt_username) != 0){
-        espClient.print("&username=");
-        espClient.print(base64::encode(mqtt_username));
-        espClient.print("&password=");
-        espClient.print(base64::encode(mqtt_password));
+  //handle the rings detected by the sample timer
+  ringRecord ring;
+  while (popRing(ring)) {
+    inputChannel &ch = channels[ring.channel];
+    if (ch.type == CHANNEL_CONTACT) {
+      if (ring.event == RING_STARTED) {
+        startRing(ring.channel, ring.startUs);
+      } else {
+        journal.setDuration(ch.journalSeq, (ring.endUs - ring.startUs) / 1000);
+        endContact(ring.channel);
       }
-      
-      espClient.println(" HTTP/1.1");
-      espClient.print("Host: ");
-      espClient.print(String(mqtt_server));
-      espClient.print(":");
-      espClient.println(String(mqtt_port));
-      espClient.println("User-Agent: doorbell-modernizr");
-      espClient.println("Connection: close");
-      espClient.println();
-      espClient.stop();
-   } else {
-     Serial.println("connect failed");
-   }
-      //wait 5 seconds, then publish the off message
-      delay( 5000 );
-    if (espClient.connect(mqtt_server,atoi(mqtt_port))){
-        Serial.println("sending 'off' message to Domiticz");
-        espClient.print("GET /json.htm?type=command&param=udevice&idx=");
-        espClient.print(String(dz_idx));
-        espClient.print("&nvalue=0");
-  
-         if (strlen(mqtt_username) != 0){
-          espClient.print("&username=");
-          espClient.print(base64::encode(mqtt_username));
-          espClient.print("&password=");
-          espClient.print(base64::encode(mqtt_password));
-        }
-        
-        espClient.println(" HTTP/1.1");
-        espClient.print("Host: ");
-        espClient.print(String(mqtt_server));
-        espClient.print(":");
-        espClient.println(String(mqtt_port));
-        espClient.println("User-Agent: doorbell-modernizr");
-        espClient.println("Connection: close");
-        espClient.println();
-        espClient.stop();
-     } else {
-       Serial.println("connect failed");
-     } 
-   }
+    } else if (ring.event == RING_STARTED) {
+      ch.classifier.ringStarted();
+      if (ch.coalescer.ringStarted(millis())) {
+        startRing(ring.channel, ring.startUs);
+      } else {
+        foldRing(ring.channel);
+      }
+    } else {
+      uint32_t freeHeap = dispatcher.allocCheck.start();
+      FixedText<32> name;
+      formatChannelName(ring.channel, name);
+      Serial.print(name.c_str());
+      Serial.print(" ring ended after ");
+      Serial.print((ring.endUs - ring.startUs) / 1000);
+      Serial.println(" ms");
+      ch.classifier.ringEnded(ring.startUs, ring.endUs);
+      journal.setDuration(ch.journalSeq, (ring.endUs - ring.startUs) / 1000);
+      dispatcher.allocCheck.stop(freeHeap, "ending a ring");
+    }
+  }
+  if (edgeOverflows != 0) {
+    Serial.print("Edge buffer overflow, dropped edges: ");
+    Serial.println(edgeOverflows);
+    edgeOverflows = 0;
+  }
+
+  serviceRing();
 
-   // OpenHAB
-   if (strlen(oh_itemid) != 0){
+  for (int c = 0; c < channelCount; c++) {
+    inputChannel &ch = channels[c];
+    pressEvent press;
+    if (ch.classifier.poll(micros(), press) && ch.coalescer.pressCompleted()) {
+      sendPressEvent(c, press);
+    }
+    if (ch.coalescer.poll(millis(), ch.classifier.busy(), press)) {
+      sendPressEvent(c, press);
+    }
+  }
 
-      Serial.println("sending 'ON' message to openHAB");
-      http.begin("http://" + String(mqtt_server) + ":" + String(mqtt_port) +"/rest/items/" + String(oh_itemid)); 
-      http.POST("ON");
-      http.end();
+  if (millis() - lastMetricsMillis >= METRICS_INTERVAL) {
+    lastMetricsMillis = millis();
+    if (mqttConfigured() && client.connected()) {
+      publishMetrics();
+    }
+  }
 
-      delay(5000);
+  udpNotifier.poll();
+  mqttPublisher.poll(client.connected());
+  mqttBackend.settle();
+  dispatcher.poll();
+  if (!dispatcher.busy() && !ringHeld()) {
+    dnsCache.poll();
+  }
 
-      Serial.println("sending 'OFF' message to openHAB");
-      http.begin("http://" + String(mqtt_server) + ":" + String(mqtt_port) +"/rest/items/" + String(oh_itemid)); 
-      http.POST("OFF"); 
-      http.end();
-    
-   }  
+  if (outbox.size() != 0 && millis() - lastOutboxRetryMillis >= OUTBOX_RETRY_INTERVAL) {
+    lastOutboxRetryMillis = millis();
+    for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+      replaying[backend] = backendReachable(backend);
+    }
   }
+  for (int backend = 0; backend < BACKEND_COUNT; backend++) {
+    if (replaying[backend] && dispatcher.idle(backend)) {
+      replayNext(backend);
+    }
+  }
+
+  //the pressed and reset screens stay up while a ring or the reset button is being held,
+  //the mqtt failure screen while there is no connection
+  if (!ringHeld() && !resetHeld() && (!mqttConfigured() || client.connected())) {
+    drawDefaultScreen();
+  }
+
+  if (strcmp(idle_sleep, "on") == 0 && idle()) {
+    idleSleep();
+  }
+}
+
+//Select the wifi sleep mode, light sleep is only used when idle sleep is on
+void setupSleep() {
+  WiFi.setSleepMode(strcmp(idle_sleep, "on") == 0 ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);
+}
+
+//true when nothing is going on that needs the sample timer or a busy loop
+bool idle() {
+  if (apstarted || ringHead != ringTail || edgeHead != edgeTail || ringHeld() ||
+      resetButton != RESET_IDLE || resetHistory != 0 || outbox.size() != 0 || dispatcher.busy() ||
+      mqttPublisher.pending() != 0 || udpNotifier.busy()) {
+    return false;
+  }
+  for (int c = 0; c < channelCount; c++) {
+    if (!channels[c].detector.idle() || channels[c].classifier.busy() || channels[c].coalescer.open) {
+      return false;
+    }
+  }
+  return true;
 }
 
+//Sleep for up to IDLE_SLEEP_MS, an input or the reset button wakes the chip and ends it
+void idleSleep() {
+  timer1_disable();
+  noInterrupts();
+  wakeUs = 0;
+  idleSleeping = true;
+  for (int c = 0; c < channelCount; c++) {
+    wifi_enable_gpio_wakeup(channels[c].pin, channels[c].activeHigh ? GPIO_PIN_INTR_HILEVEL : GPIO_PIN_INTR_LOLEVEL);
+  }
+  attachInterrupt(digitalPinToInterrupt(RESET_PIN), resetWakeInterrupt, ONLOW);
+  wifi_enable_gpio_wakeup(RESET_PIN, GPIO_PIN_INTR_LOLEVEL);
+  interrupts();
+
+  unsigned long start = millis();
+  delay(IDLE_SLEEP_MS);  //cut short by wakeUp()
+  idleWaitMillis += millis() - start;
+  sleepCount++;
+
+  noInterrupts();
+  if (idleSleeping) {
+    idleSleeping = false;
+    restoreInputPins();
+  }
+  interrupts();
+  wifi_disable_gpio_wakeup();
+  detachInterrupt(digitalPinToInterrupt(RESET_PIN));
+  startSampler();
+}
+
+//The first wake interrupt: back to edge capture
+ICACHE_RAM_ATTR void wakeUp() {
+  idleSleeping = false;
+  wakeUs = micros();
+  restoreInputPins();
+  esp_schedule();  //resume loop() from its delay(), it restarts the sample timer
+}
+
+ICACHE_RAM_ATTR void resetWakeInterrupt() {
+  if (idleSleeping) {
+    wakeUp();
+  }
+}
+
+//Undo the wake up level interrupts: the inputs to edge capture, the reset button to no interrupt
+ICACHE_RAM_ATTR void restoreInputPins() {
+  for (uint8_t c = 0; c < channelCount; c++) {
+    GPC(channels[c].pin) = (GPC(channels[c].pin) & ~(0xF << GPCI)) | (CHANGE << GPCI);
+  }
+  GPC(RESET_PIN) &= ~(0xF << GPCI);
+}
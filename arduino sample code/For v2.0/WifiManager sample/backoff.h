@@ -0,0 +1,57 @@
+/***************************************************************************
+ Reconnect backoff for the Doorbell modernizr
+
+ After every failed attempt the wait doubles, from minMs up to maxMs. The actual wait is picked at
+ random between half and all of it, so devices that lost the same server at the same moment do not
+ all come back at the same moment. expedite() allows one attempt right away, for when a message is
+ waiting; the wait after it still grows.
+ ***************************************************************************/
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+struct Backoff {
+  uint32_t minMs = 1000;
+  uint32_t maxMs = 60000;
+
+  uint8_t failures = 0;
+  uint32_t lastMs = 0;
+  uint32_t waitMs = 0;  //0: try right away
+
+  void configure(uint32_t min, uint32_t max) {
+    minMs = min;
+    maxMs = max;
+  }
+
+  bool due(uint32_t nowMs) const {
+    return nowMs - lastMs >= waitMs;
+  }
+
+  //an attempt failed, pick the wait before the next one
+  void failed(uint32_t nowMs) {
+    uint32_t limit = maxMs;
+    if (failures < 31 && (minMs << failures) >> failures == minMs) {
+      limit = std::min(minMs << failures, maxMs);
+    }
+    if (failures < 255) {
+      failures++;
+    }
+    lastMs = nowMs;
+    waitMs = limit / 2 + random(limit / 2 + 1);
+  }
+
+  void succeeded() {
+    failures = 0;
+    waitMs = 0;
+  }
+
+  void expedite() {
+    waitMs = 0;
+  }
+
+  //ms until the next attempt
+  uint32_t remainingMs(uint32_t nowMs) const {
+    return due(nowMs) ? 0 : waitMs - (nowMs - lastMs);
+  }
+};
+
+#endif
@@ -0,0 +1,97 @@
+/***************************************************************************
+ Ring coalescing and rate limiting for the Doorbell modernizr
+
+ RingCoalescer folds a burst of rings into one notification. The first ring of a
+ burst and its press event are sent right away; rings and presses that follow within
+ the coalescing window of the previous ring are only counted. When the burst is over
+ and presses have been folded, one burst event with the total ring count is sent.
+ A window of 0 disables coalescing. The window may not be longer than the hold time of a ring,
+ a folded ring only extends the hold while its 'off' has not been sent yet.
+
+ RateLimiter is a token bucket per backend: ratePerMinute notifications per minute,
+ with bursts up to ratePerMinute. A rate of 0 disables the limit.
+ ***************************************************************************/
+#ifndef COALESCER_H
+#define COALESCER_H
+
+struct RingCoalescer {
+  uint32_t windowMs = 5000;
+
+  bool open = false;
+  uint32_t startMs = 0;
+  uint32_t lastRingMs = 0;
+  uint16_t rings = 0;
+  uint16_t presses = 0;
+  uint16_t foldedPresses = 0;
+
+  //returns true when this ring starts a new burst and has to be sent
+  bool ringStarted(uint32_t nowMs) {
+    if (!open || nowMs - lastRingMs > windowMs) {
+      open = true;
+      startMs = nowMs;
+      rings = 0;
+      presses = 0;
+      foldedPresses = 0;
+    }
+    lastRingMs = nowMs;
+    rings++;
+    return rings == 1;
+  }
+
+  //returns true when this press event is the first of the burst and has to be sent
+  bool pressCompleted() {
+    presses++;
+    if (presses == 1) {
+      return true;
+    }
+    foldedPresses++;
+    return false;
+  }
+
+  //returns true and fills event when a burst with folded presses is over,
+  //busy tells that the classifier is still working on a press
+  bool poll(uint32_t nowMs, bool busy, pressEvent &event) {
+    if (!open || busy || nowMs - lastRingMs <= windowMs) {
+      return false;
+    }
+    open = false;
+    if (foldedPresses == 0) {
+      return false;
+    }
+    event.type = PRESS_BURST;
+    event.count = rings > 255 ? 255 : rings;
+    event.durationMs = lastRingMs - startMs;
+    return true;
+  }
+};
+
+struct RateLimiter {
+  uint16_t ratePerMinute = 0;
+  uint32_t credit = 0;  //in 1/60000 tokens
+  uint32_t lastMs = 0;
+  uint32_t dropped = 0;
+
+  void configure(uint16_t rate) {
+    ratePerMinute = rate;
+    credit = rate * 60000UL;
+  }
+
+  //take a token, returns false (and counts a drop) when the rate is exceeded
+  bool allow(uint32_t nowMs) {
+    if (ratePerMinute == 0) {
+      return true;
+    }
+    uint32_t max = ratePerMinute * 60000UL;
+    uint32_t elapsed = nowMs - lastMs;
+    lastMs = nowMs;
+    credit = elapsed >= 60000 ? max : std::min(max, credit + elapsed * ratePerMinute);
+    if (credit < 60000) {
+      dropped++;
+      return false;
+    }
+    credit -= 60000;
+    return true;
+  }
+};
+
+#endif
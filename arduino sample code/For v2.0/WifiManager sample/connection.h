@@ -0,0 +1,130 @@
+/***************************************************************************
+ Keep-alive connections for the Doorbell modernizr
+
+ One warm tcp connection per http endpoint. open() reuses the connection when it is still up and
+ goes to the same host and port, else it connects again; nothing reconnects until a request needs
+ it. The connect times are measured, so the time saved by the reuses can be reported. With a
+ resolver, a host name is connected to by its cached address (see dnscache.h).
+
+ A request is written with as few writes as possible, normally one, so it leaves in one tcp segment;
+ the writes are counted to show it. With noDelay the socket has Nagle's algorithm off, so the rest
+ of a request that did need more writes is not held back until the first part is acknowledged.
+
+ With a certificate fingerprint the connection uses TLS (see tls.h, only with TLS_SUPPORT 1), the
+ connect times then include the handshake.
+
+ Connecting blocks, so it is given CONNECT_TIMEOUT (TLS_CONNECT_TIMEOUT with the handshake) instead
+ of the default 5 s. After a failed connect the host counts as unreachable and the wait before it
+ is retried from the outbox grows (see backoff.h); a new ring still tries it right away.
+ ***************************************************************************/
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#define CONNECT_TIMEOUT 1000
+#define TLS_CONNECT_TIMEOUT 3000
+#define UNREACHABLE_RETRY_MIN 10000
+#define UNREACHABLE_RETRY_MAX 300000
+
+struct KeepAliveConnection {
+  WiFiClient plain;
+#if TLS_SUPPORT
+  PinnedTlsClient secure;
+#endif
+  bool tls = false;
+  char host[40] = "";
+  uint16_t port = 0;
+
+  uint32_t connects = 0;
+  uint32_t reuses = 0;
+  uint32_t connectUs = 0;  //total time spent connecting
+  uint32_t requests = 0;
+  uint32_t writes = 0;
+  bool reused = false;     //the last open() reused the connection
+  bool noDelay = false;    //set TCP_NODELAY on the socket
+  DnsCache *resolver = NULL;
+  Backoff unreachable;     //after failed connects
+
+  KeepAliveConnection() {
+    plain.setTimeout(CONNECT_TIMEOUT);
+#if TLS_SUPPORT
+    secure.setTimeout(TLS_CONNECT_TIMEOUT);
+#endif
+    unreachable.configure(UNREACHABLE_RETRY_MIN, UNREACHABLE_RETRY_MAX);
+  }
+
+  //false while the host is backed off after failed connects
+  bool reachable() const {
+    return unreachable.due(millis());
+  }
+
+  WiFiClient& socket() {
+#if TLS_SUPPORT
+    if (tls) {
+      return secure;
+    }
+#endif
+    return plain;
+  }
+
+  //use TLS pinned to the fingerprint, or plain tcp when it is empty. Returns false when the
+  //fingerprint is not valid, or is set without TLS_SUPPORT (the connection is plain tcp then).
+  bool secureWith(const char *fingerprint) {
+    close();
+    unreachable.succeeded();
+#if TLS_SUPPORT
+    tls = fingerprint[0] != 0;
+    return !tls || secure.configure(fingerprint);
+#else
+    tls = false;
+    return fingerprint[0] == 0;
+#endif
+  }
+
+  //make sure the connection is up, returns false when it could not connect
+  bool open(const char *toHost, uint16_t toPort) {
+    WiFiClient &client = socket();
+    reused = client.connected() && toPort == port && strcmp(toHost, host) == 0;
+    if (reused) {
+      reuses++;
+      return true;
+    }
+    close();
+    uint32_t startUs = micros();
+    IPAddress address;
+    if (resolver != NULL ? !resolver->resolve(toHost, address) || !client.connect(address, toPort)
+                         : !client.connect(toHost, toPort)) {
+      unreachable.failed(millis());
+      return false;
+    }
+    unreachable.succeeded();
+    connectUs += micros() - startUs;
+    connects++;
+    client.setNoDelay(noDelay);
+    strlcpy(host, toHost, sizeof(host));
+    port = toPort;
+    return true;
+  }
+
+  void close() {
+    socket().stop();
+    host[0] = 0;
+  }
+
+  uint32_t averageConnectUs() const {
+    return connects == 0 ? 0 : connectUs / connects;
+  }
+
+  //estimated time the reuses saved, a reuse saves an average connect
+  uint32_t savedUs() const {
+    return reuses * averageConnectUs();
+  }
+
+  //{"connects":..,"reuses":..,"connect_avg":..,"saved":..,"requests":..,"writes":..}, times in us
+  void format(char *buf, size_t len) const {
+    snprintf(buf, len, "{\"connects\":%lu,\"reuses\":%lu,\"connect_avg\":%lu,\"saved\":%lu,\"requests\":%lu,\"writes\":%lu}",
+             (unsigned long)connects, (unsigned long)reuses, (unsigned long)averageConnectUs(), (unsigned long)savedUs(),
+             (unsigned long)requests, (unsigned long)writes);
+  }
+};
+
+#endif
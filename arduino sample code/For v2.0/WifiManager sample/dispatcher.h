@@ -0,0 +1,282 @@
+/***************************************************************************
+ Notification dispatcher for the Doorbell modernizr
+
+ Every backend implements NotifyBackend: begin() starts sending a message and poll() moves it
+ on without blocking until the message is delivered or has failed. The dispatcher keeps a small
+ queue of messages per backend and runs the backends side by side from loop(), so an 'on' message
+ is on its way to every backend within the same loop iteration instead of one after the other.
+
+ HttpBackend is the state machine the http backends share: write the request on the keep-alive
+ connection of the backend (see connection.h) as far as the send buffer allows, then feed the
+ response to the parser (see httpresponse.h) as it comes in, up to the end of its body, so the
+ connection can be used for the next request. Writing and reading share one deadline. A reused connection the server closed in the
+ meantime is noticed when nothing comes back, the request is then sent once more on a new one.
+ Connecting is the only step that blocks, WiFiClient has no asynchronous connect; on a local
+ network it takes a few ms, with keep-alive it is only needed now and then, and a host that is
+ down holds it up for CONNECT_TIMEOUT at most (see connection.h).
+
+ The request is built in a fixed buffer of the backend from the pre-rendered parts in templates.h.
+ ***************************************************************************/
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#define DISPATCH_MAX_BACKENDS 4
+#define DISPATCH_QUEUE_SIZE 4
+#define HTTP_RESPONSE_TIMEOUT 5000
+#define HTTP_REQUEST_SIZE 512
+
+//DISPATCH_REJECTED: the backend refused the message (an http 4xx), sending it again will not help.
+//DISPATCH_SENT: the message is on its way and the queue moves on, the backend reports the result
+//itself later (an mqtt QoS 1 publish waiting for its PUBACK).
+enum dispatchResult { DISPATCH_BUSY, DISPATCH_OK, DISPATCH_FAILED, DISPATCH_REJECTED, DISPATCH_SENT };
+
+struct notifyMessage {
+  outboxEntry entry;   //what to send, this goes to the outbox when it fails
+  bool replay;         //sent again from the outbox
+  latencyTrace trace;  //edgeUs is 0 when the message is not traced
+};
+
+class NotifyBackend {
+ public:
+  //start sending a message: render it, without allocating
+  virtual void begin(notifyMessage &message) = 0;
+  //move the message on, returns DISPATCH_BUSY until it is delivered or has failed
+  virtual uint8_t poll(notifyMessage &message) = 0;
+};
+
+class HttpBackend : public NotifyBackend {
+ public:
+  KeepAliveConnection connection;
+  HttpResponse response;
+
+  void begin(notifyMessage &message) override {
+    message.trace.dispatchUs = micros();
+    request.clear();
+    buildRequest(message, request);
+    state = HTTP_CONNECT;
+    retried = false;
+    startMillis = millis();
+  }
+
+  uint8_t poll(notifyMessage &message) override {
+    if (state == HTTP_WRITE && expired()) {
+      Serial.println("request not sent in time");
+      return finish(DISPATCH_FAILED, false);
+    }
+    switch (state) {
+      case HTTP_CONNECT:
+        if (request.overflowed()) {
+          Serial.println("request too long");
+          return finish(DISPATCH_FAILED, false);
+        }
+        if (!connection.open(host(), port())) {
+          Serial.println("connect failed");
+          return finish(DISPATCH_FAILED, false);
+        }
+        message.trace.connectUs = micros();
+        written = 0;
+        state = HTTP_WRITE;
+        //fall through, most requests fit in the send buffer at once
+
+      case HTTP_WRITE: {
+        //the whole request in one write when it fits in the send buffer (it always does on a fresh
+        //connection), else what fits now and the rest on the next poll
+        size_t length = std::min(request.length() - written, (size_t)connection.socket().availableForWrite());
+        if (length > 0) {
+          written += connection.socket().write((const uint8_t*)request.c_str() + written, length);
+          connection.writes++;
+        }
+        if (written < request.length()) {
+          return connection.socket().connected() ? (uint8_t)DISPATCH_BUSY : retry();
+        }
+        connection.requests++;
+        message.trace.writtenUs = micros();
+        response.begin();
+        received = false;
+        state = HTTP_RESPONSE;
+        return DISPATCH_BUSY;
+      }
+
+      case HTTP_RESPONSE:
+        //what came in is read before the deadline is checked: after a stall of loop() the
+        //response can be waiting in the buffer
+        while (connection.socket().available()) {
+          received = true;
+          if (response.feed(connection.socket().read())) {
+            message.trace.responseUs = micros();
+            return finish(result(response), response.keepAlive);
+          }
+        }
+        if (!connection.socket().connected()) {
+          //a reused connection the server had already closed: the request did not get there
+          if (!received) {
+            return retry();
+          }
+          Serial.println("connection closed before the end of the response");
+          return finish(DISPATCH_FAILED, false);
+        }
+        if (expired()) {
+          Serial.println("no response in time");
+          return finish(DISPATCH_FAILED, false);
+        }
+        return DISPATCH_BUSY;
+    }
+    return DISPATCH_FAILED;
+  }
+
+ protected:
+  virtual const char* host() = 0;
+  virtual uint16_t port() = 0;
+  virtual void buildRequest(const notifyMessage &message, TextBuffer &request) = 0;
+
+  //true when the backend accepted the message
+  virtual bool accepted(const HttpResponse &response) {
+    return response.status >= 200 && response.status < 300;
+  }
+
+  uint8_t result(const HttpResponse &response) {
+    if (accepted(response)) {
+      return DISPATCH_OK;
+    }
+    if (response.status >= 400 && response.status < 500) {
+      Serial.print("request rejected with status ");
+      Serial.println(response.status);
+      return DISPATCH_REJECTED;
+    }
+    return DISPATCH_FAILED;
+  }
+
+ private:
+  enum { HTTP_CONNECT, HTTP_WRITE, HTTP_RESPONSE };
+
+  bool expired() const {
+    return millis() - startMillis > HTTP_RESPONSE_TIMEOUT;
+  }
+
+  //send the request once more over a new connection
+  uint8_t retry() {
+    connection.close();
+    if (retried || !connection.reused) {
+      return finish(DISPATCH_FAILED, false);
+    }
+    retried = true;
+    state = HTTP_CONNECT;
+    return DISPATCH_BUSY;
+  }
+
+  uint8_t finish(uint8_t result, bool keep) {
+    if (!keep) {
+      connection.close();
+    }
+    return result;
+  }
+
+  FixedText<HTTP_REQUEST_SIZE> request;
+  uint8_t state = HTTP_CONNECT;
+  bool retried = false;
+  bool received = false;
+  size_t written = 0;
+  unsigned long startMillis = 0;
+};
+
+typedef void (*dispatchCallback)(uint8_t backend, const notifyMessage &message, uint8_t result);
+
+struct Dispatcher {
+  struct slot {
+    NotifyBackend *backend;
+    notifyMessage queue[DISPATCH_QUEUE_SIZE];  //queue[0] is being sent when busy
+    uint8_t size;
+    bool busy;
+    uint8_t result;
+  };
+
+  slot slots[DISPATCH_MAX_BACKENDS];
+  uint8_t count = 0;
+  dispatchCallback completed;
+  AllocCheck allocCheck;  //rendering a message must not allocate
+
+  explicit Dispatcher(dispatchCallback callback) : completed(callback) {}
+
+  void add(NotifyBackend *backend) {
+    slots[count].backend = backend;
+    slots[count].size = 0;
+    slots[count].busy = false;
+    count++;
+  }
+
+  //queue a message and start it right away when the backend is free, the result is reported
+  //from poll(). Returns false when the queue is full: the message is not sent, and the caller
+  //fails it once it is ready for the callback (its journal record may not be written yet).
+  bool dispatch(uint8_t backend, const notifyMessage &message) {
+    slot &s = slots[backend];
+    if (s.size == DISPATCH_QUEUE_SIZE) {
+      Serial.println("dispatch queue full");
+      return false;
+    }
+    s.queue[s.size++] = message;
+    service(backend, false);
+    return true;
+  }
+
+  //move every backend on and report the results, call from loop()
+  void poll() {
+    for (uint8_t backend = 0; backend < count; backend++) {
+      service(backend, true);
+    }
+  }
+
+  bool idle(uint8_t backend) const {
+    return slots[backend].size == 0;
+  }
+
+  //true when no backend but this one has messages on the way
+  bool idleExcept(uint8_t except) const {
+    for (uint8_t backend = 0; backend < count; backend++) {
+      if (backend != except && !idle(backend)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool busy() const {
+    for (uint8_t backend = 0; backend < count; backend++) {
+      if (!idle(backend)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  void service(uint8_t backend, bool report) {
+    slot &s = slots[backend];
+    if (s.size == 0) {
+      return;
+    }
+    if (!s.busy) {
+      uint32_t freeHeap = allocCheck.start();
+      s.backend->begin(s.queue[0]);
+      allocCheck.stop(freeHeap, "rendering a message");
+      s.busy = true;
+      s.result = DISPATCH_BUSY;
+    }
+    if (s.result == DISPATCH_BUSY) {
+      s.result = s.backend->poll(s.queue[0]);
+    }
+    if (s.result == DISPATCH_BUSY || !report) {
+      return;
+    }
+    notifyMessage done = s.queue[0];
+    s.size--;
+    for (uint8_t i = 0; i < s.size; i++) {
+      s.queue[i] = s.queue[i + 1];
+    }
+    s.busy = false;
+    if (s.result != DISPATCH_SENT) {
+      completed(backend, done, s.result);
+    }
+  }
+};
+
+#endif
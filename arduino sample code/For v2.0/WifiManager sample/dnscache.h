@@ -0,0 +1,111 @@
+/***************************************************************************
+ Address cache for the Doorbell modernizr
+
+ The servers are configured by name or address. A name is looked up once and the address is kept,
+ so connecting for a ring never waits for dns. The addresses are looked up again in the background
+ every DNS_REFRESH_INTERVAL (the esp8266 dns client does not report the ttl); when that fails, the
+ last known address is kept. Only a name that was never resolved is looked up while connecting.
+
+ Lookups are timed into a histogram.
+ ***************************************************************************/
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#define DNS_CACHE_SIZE 2
+#define DNS_REFRESH_INTERVAL 600000
+#define DNS_TIMEOUT 2000
+
+struct DnsCache {
+  struct entry {
+    char host[40];  //empty when the entry is free
+    IPAddress address;
+    unsigned long resolvedMillis;
+  };
+
+  entry entries[DNS_CACHE_SIZE] = {};
+  uint8_t next = 0;  //entry to reuse when all are taken
+
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+  uint32_t refreshes = 0;
+  uint32_t failures = 0;
+  LatencyHistogram lookupLatency;
+
+  //address of a host name or of an address literal, false when it cannot be resolved
+  bool resolve(const char *host, IPAddress &address) {
+    if (address.fromString(host)) {
+      return true;
+    }
+    entry *e = find(host);
+    if (e != NULL) {
+      hits++;
+      address = e->address;
+      return true;
+    }
+    misses++;
+    if (!lookup(host, address)) {
+      return false;
+    }
+    e = &entries[next];
+    next = (next + 1) % DNS_CACHE_SIZE;
+    strlcpy(e->host, host, sizeof(e->host));
+    e->address = address;
+    e->resolvedMillis = millis();
+    return true;
+  }
+
+  //look up one entry that is due again, call from loop() when nothing else is going on
+  void poll() {
+    for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++) {
+      entry &e = entries[i];
+      if (e.host[0] == 0 || millis() - e.resolvedMillis < DNS_REFRESH_INTERVAL) {
+        continue;
+      }
+      IPAddress address;
+      refreshes++;
+      if (lookup(e.host, address)) {
+        e.address = address;
+      }
+      //also after a failure, keep the last address and try again after the interval
+      e.resolvedMillis = millis();
+      return;
+    }
+  }
+
+  //forget everything, after a configuration change
+  void clear() {
+    for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++) {
+      entries[i].host[0] = 0;
+    }
+  }
+
+  //{"hits":..,"misses":..,"refreshes":..,"failures":..}
+  void format(char *buf, size_t len) const {
+    snprintf(buf, len, "{\"hits\":%lu,\"misses\":%lu,\"refreshes\":%lu,\"failures\":%lu}",
+             (unsigned long)hits, (unsigned long)misses, (unsigned long)refreshes, (unsigned long)failures);
+  }
+
+ private:
+  entry* find(const char *host) {
+    for (uint8_t i = 0; i < DNS_CACHE_SIZE; i++) {
+      if (entries[i].host[0] != 0 && strcmp(entries[i].host, host) == 0) {
+        return &entries[i];
+      }
+    }
+    return NULL;
+  }
+
+  bool lookup(const char *host, IPAddress &address) {
+    uint32_t startUs = micros();
+    bool found = WiFi.hostByName(host, address, DNS_TIMEOUT) == 1;
+    lookupLatency.add(micros() - startUs);
+    if (!found) {
+      failures++;
+      Serial.print("dns lookup failed for ");
+      Serial.println(host);
+    }
+    return found;
+  }
+};
+
+#endif
@@ -0,0 +1,161 @@
+/***************************************************************************
+ Incremental http response parser for the Doorbell modernizr
+
+ Fed one byte at a time as the response comes in, so nothing has to wait for the whole response.
+ Parses the status line, the headers needed to find the end of the response (Content-Length,
+ chunked Transfer-Encoding, Connection) and picks the "status" field out of a json body, which is
+ how Domoticz tells whether a command was accepted ({"status" : "OK", ...} or "ERR").
+ ***************************************************************************/
+#ifndef HTTPRESPONSE_H
+#define HTTPRESPONSE_H
+
+struct HttpResponse {
+  int status;            //http status code, 0 until the status line is in
+  bool keepAlive;        //the connection can be used for the next request
+  bool complete;         //the whole response has been read
+  char jsonStatus[16];   //value of the json "status" field, empty when there is none
+
+  void begin() {
+    status = 0;
+    keepAlive = true;
+    complete = false;
+    jsonStatus[0] = 0;
+    state = STATUS_LINE;
+    lineLength = 0;
+    contentLength = -1;
+    chunked = false;
+    jsonState = JSON_KEY;
+    keyMatched = 0;
+    valueLength = 0;
+  }
+
+  //feed the next byte, returns true when the response is complete
+  bool feed(char c) {
+    switch (state) {
+      case STATUS_LINE:
+      case HEADER:
+      case CHUNK_SIZE:
+      case CHUNK_END:
+      case TRAILER:
+        if (c != '\n') {
+          if (c != '\r' && lineLength < sizeof(line) - 1) {
+            line[lineLength++] = c;
+          }
+          return false;
+        }
+        line[lineLength] = 0;
+        lineLength = 0;
+        headLine();
+        break;
+
+      case BODY:
+        scanJson(c);
+        if (--remaining == 0) {
+          if (chunked) {
+            state = CHUNK_END;
+          } else {
+            complete = true;
+          }
+        }
+        break;
+    }
+    return complete;
+  }
+
+ private:
+  enum { STATUS_LINE, HEADER, BODY, CHUNK_SIZE, CHUNK_END, TRAILER };
+  enum { JSON_KEY, JSON_COLON, JSON_VALUE, JSON_STRING, JSON_DONE };
+
+  uint8_t state;
+  char line[64];
+  uint8_t lineLength;
+  long contentLength;
+  long remaining;
+  bool chunked;
+  uint8_t jsonState;
+  uint8_t keyMatched;  //characters of "status" (with quotes) matched so far
+  uint8_t valueLength;
+
+  void headLine() {
+    switch (state) {
+      case STATUS_LINE:
+        //"HTTP/1.1 200 OK", a HTTP/1.0 server closes the connection
+        status = strlen(line) > 9 ? atoi(line + 9) : 0;
+        keepAlive = strncmp(line, "HTTP/1.1", 8) == 0;
+        state = HEADER;
+        break;
+
+      case HEADER:
+        if (line[0] != 0) {
+          if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            contentLength = atol(line + 15);
+          } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line + 18, "chunked") != NULL) {
+            chunked = true;
+          } else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close") != NULL) {
+            keepAlive = false;
+          }
+        } else if (chunked) {
+          state = CHUNK_SIZE;
+        } else if (contentLength > 0) {
+          remaining = contentLength;
+          state = BODY;
+        } else {
+          //without a length the end of the body is unknown, the connection can not be used again
+          keepAlive = keepAlive && contentLength == 0;
+          complete = true;
+        }
+        break;
+
+      case CHUNK_SIZE:
+        remaining = strtol(line, NULL, 16);
+        state = remaining > 0 ? BODY : TRAILER;
+        break;
+
+      case CHUNK_END:
+        state = CHUNK_SIZE;
+        break;
+
+      case TRAILER:
+        complete = line[0] == 0;
+        break;
+    }
+  }
+
+  //find "status" : "<value>" in the body
+  void scanJson(char c) {
+    static const char key[] = "\"status\"";
+    switch (jsonState) {
+      case JSON_KEY:
+        keyMatched = c == key[keyMatched] ? keyMatched + 1 : (c == '"' ? 1 : 0);
+        if (keyMatched == sizeof(key) - 1) {
+          jsonState = JSON_COLON;
+        }
+        break;
+      case JSON_COLON:
+        if (c == ':') {
+          jsonState = JSON_VALUE;
+        } else if (!isspace(c)) {
+          jsonState = JSON_KEY;  //it was a value, not a key
+          keyMatched = c == '"' ? 1 : 0;
+        }
+        break;
+      case JSON_VALUE:
+        if (c == '"') {
+          jsonState = JSON_STRING;
+        } else if (!isspace(c)) {
+          jsonState = JSON_DONE;
+        }
+        break;
+      case JSON_STRING:
+        if (c == '"') {
+          jsonStatus[valueLength] = 0;
+          jsonState = JSON_DONE;
+        } else if (valueLength < sizeof(jsonStatus) - 1) {
+          jsonStatus[valueLength++] = c;
+        }
+        break;
+    }
+  }
+};
+
+#endif
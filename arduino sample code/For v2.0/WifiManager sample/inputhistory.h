@@ -0,0 +1,42 @@
+/***************************************************************************
+ Bit packed input history for the Doorbell modernizr
+
+ The sample timer shifts the level of an input into a 32 bit word every sample
+ period, bit 0 is the newest sample and a set bit means the input was active (low).
+ Debouncing and pattern checks are then a mask and a bit count on that word.
+
+ These are called from the sample timer interrupt, so they are forced inline
+ (the interrupt handler is in IRAM, libgcc's popcount is not).
+ ***************************************************************************/
+#ifndef INPUTHISTORY_H
+#define INPUTHISTORY_H
+
+#define HISTORY_INLINE static inline __attribute__((always_inline))
+
+HISTORY_INLINE uint32_t historyMask(uint8_t samples) {
+  return samples >= 32 ? 0xFFFFFFFFUL : (1UL << samples) - 1;
+}
+
+HISTORY_INLINE uint8_t historyBitCount(uint32_t bits) {
+  bits = bits - ((bits >> 1) & 0x55555555UL);
+  bits = (bits & 0x33333333UL) + ((bits >> 2) & 0x33333333UL);
+  return (((bits + (bits >> 4)) & 0x0F0F0F0FUL) * 0x01010101UL) >> 24;
+}
+
+//number of active samples within the last samples
+HISTORY_INLINE uint8_t historyActive(uint32_t history, uint8_t samples) {
+  return historyBitCount(history & historyMask(samples));
+}
+
+//true when the input was active for all of the last samples
+HISTORY_INLINE bool historyStableActive(uint32_t history, uint8_t samples) {
+  uint32_t mask = historyMask(samples);
+  return (history & mask) == mask;
+}
+
+//true when the input was idle for all of the last samples
+HISTORY_INLINE bool historyStableIdle(uint32_t history, uint8_t samples) {
+  return (history & historyMask(samples)) == 0;
+}
+
+#endif
@@ -0,0 +1,210 @@
+/***************************************************************************
+ On flash event journal for the Doorbell modernizr
+
+ An append only log of 16 byte records in a few raw flash sectors. Every sector starts
+ with a header (magic, erase count, sequence number of its first record) followed by
+ JOURNAL_SLOTS records. The sectors are filled in turn; when the newest sector is full,
+ the oldest one is erased and reused, so every sector gets the same number of erases and
+ the journal always holds the last (JOURNAL_SECTORS - 1) * JOURNAL_SLOTS records at least.
+
+ Record n always lives in sector (n / JOURNAL_SLOTS) % JOURNAL_SECTORS, slot n % JOURNAL_SLOTS,
+ so nothing has to be kept in ram to find it.
+
+ Flash bits can only be cleared without an erase. Fields that are only known later (the
+ duration and the delivery result per backend) are written as all ones and cleared in place
+ when they become known. The delivery results are ordered so a failed or dropped message that
+ is delivered later on can still become ok.
+ ***************************************************************************/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_SECTORS 4
+#define JOURNAL_RECORD_SIZE 16
+#define JOURNAL_SLOTS (SPI_FLASH_SEC_SIZE / JOURNAL_RECORD_SIZE - 1)  //the first slot holds the header
+#define JOURNAL_MAGIC 0x4C4E524AUL  //"JRNL"
+#define JOURNAL_EMPTY 0xFFFFFFFFUL
+#define JOURNAL_NO_DURATION 0xFFFF
+
+enum journalType { JOURNAL_BOOT, JOURNAL_RING, JOURNAL_PRESS };
+
+//delivery result of one backend, 2 bits per backend
+enum journalDelivery {
+  DELIVERY_NONE = 3,     //not sent (erased state), backend not configured
+  DELIVERY_FAILED = 2,
+  DELIVERY_DROPPED = 1,  //dropped by the rate limiter
+  DELIVERY_OK = 0
+};
+
+struct journalRecord {
+  uint32_t seq;         //record number, JOURNAL_EMPTY for a free slot
+  uint32_t uptimeMs;    //millis() at the event
+  uint16_t boot;        //number of the boot the event happened in
+  uint16_t durationMs;  //ring or press duration, JOURNAL_NO_DURATION while unknown
+  uint8_t type;         //journalType
+  uint8_t channel;
+  uint8_t detail;       //press type for JOURNAL_PRESS, reset reason for JOURNAL_BOOT
+  uint8_t delivery;     //journalDelivery of backend b in bits 2b and 2b+1
+};
+
+struct journalHeader {
+  uint32_t magic;
+  uint32_t eraseCount;
+  uint32_t firstSeq;
+  uint32_t reserved;
+};
+
+const char* journalTypeName(uint8_t type) {
+  switch (type) {
+    case JOURNAL_BOOT:  return "boot";
+    case JOURNAL_RING:  return "ring";
+    case JOURNAL_PRESS: return "press";
+  }
+  return "unknown";
+}
+
+const char* journalDeliveryName(uint8_t delivery) {
+  switch (delivery) {
+    case DELIVERY_NONE:    return "-";
+    case DELIVERY_OK:      return "ok";
+    case DELIVERY_DROPPED: return "dropped";
+    case DELIVERY_FAILED:  return "failed";
+  }
+  return "unknown";
+}
+
+struct FlashJournal {
+  uint32_t startOffset = 0;  //flash offset of the first sector, 0 when the journal is disabled
+  uint32_t nextSeq = 0;
+  uint16_t boot = 0;
+  uint32_t eraseCount[JOURNAL_SECTORS] = {0};
+
+  static uint8_t sectorOf(uint32_t seq) {
+    return (seq / JOURNAL_SLOTS) % JOURNAL_SECTORS;
+  }
+
+  uint32_t sectorOffset(uint8_t sector) const {
+    return startOffset + sector * SPI_FLASH_SEC_SIZE;
+  }
+
+  uint32_t recordOffset(uint32_t seq) const {
+    return sectorOffset(sectorOf(seq)) + (1 + seq % JOURNAL_SLOTS) * JOURNAL_RECORD_SIZE;
+  }
+
+  bool readHeader(uint8_t sector, journalHeader &header) const {
+    return ESP.flashRead(sectorOffset(sector), (uint32_t*)&header, sizeof(header)) && header.magic == JOURNAL_MAGIC;
+  }
+
+  //erase a sector and make it hold the records from firstSeq on
+  bool startSector(uint8_t sector, uint32_t firstSeq) {
+    journalHeader header;
+    uint32_t erases = readHeader(sector, header) ? header.eraseCount + 1 : 1;
+    if (!ESP.flashEraseSector(sectorOffset(sector) / SPI_FLASH_SEC_SIZE)) {
+      return false;
+    }
+    header = {JOURNAL_MAGIC, erases, firstSeq, JOURNAL_EMPTY};
+    eraseCount[sector] = erases;
+    return ESP.flashWrite(sectorOffset(sector), (uint32_t*)&header, sizeof(header));
+  }
+
+  //find the end of the journal, or format it when there is none; returns false when the flash fails
+  bool begin(uint32_t offset) {
+    startOffset = offset;
+    nextSeq = 0;
+    bool found = false;
+    uint32_t headFirst = 0;
+    for (uint8_t sector = 0; sector < JOURNAL_SECTORS; sector++) {
+      journalHeader header;
+      if (readHeader(sector, header)) {
+        eraseCount[sector] = header.eraseCount;
+        if (sectorOf(header.firstSeq) == sector && (!found || header.firstSeq > headFirst)) {
+          headFirst = header.firstSeq;
+          found = true;
+        }
+      } else {
+        eraseCount[sector] = 0;
+      }
+    }
+    if (!found) {
+      if (!startSector(0, 0)) {
+        startOffset = 0;
+        return false;
+      }
+      boot = 0;
+      return true;
+    }
+
+    //the slots of the newest sector are filled in order, find the first free one
+    nextSeq = headFirst;
+    journalRecord record;
+    while (nextSeq < headFirst + JOURNAL_SLOTS && read(nextSeq, record)) {
+      nextSeq++;
+    }
+    boot = nextSeq > 0 && read(nextSeq - 1, record) ? record.boot + 1 : 0;
+    return true;
+  }
+
+  bool enabled() const {
+    return startOffset != 0;
+  }
+
+  //oldest record still in flash
+  uint32_t firstSeq() const {
+    uint32_t keep = (JOURNAL_SECTORS - 1) * JOURNAL_SLOTS + nextSeq % JOURNAL_SLOTS;
+    return nextSeq > keep ? nextSeq - keep : 0;
+  }
+
+  //append a record, returns its sequence number or JOURNAL_EMPTY when it could not be written.
+  //Without flash the events are still numbered.
+  uint32_t append(uint8_t type, uint8_t channel, uint8_t detail, uint16_t durationMs, uint8_t delivery = 0xFF) {
+    if (!enabled()) {
+      return nextSeq++;
+    }
+    if (nextSeq % JOURNAL_SLOTS == 0 && nextSeq != 0 && !startSector(sectorOf(nextSeq), nextSeq)) {
+      return JOURNAL_EMPTY;
+    }
+    journalRecord record = {nextSeq, (uint32_t)millis(), boot, durationMs, type, channel, detail, delivery};
+    if (!ESP.flashWrite(recordOffset(nextSeq), (uint32_t*)&record, sizeof(record))) {
+      return JOURNAL_EMPTY;
+    }
+    return nextSeq++;
+  }
+
+  //read a record, returns false when it is no longer (or not yet) in flash
+  bool read(uint32_t seq, journalRecord &record) const {
+    if (!enabled() || seq == JOURNAL_EMPTY) {
+      return false;
+    }
+    return ESP.flashRead(recordOffset(seq), (uint32_t*)&record, sizeof(record)) && record.seq == seq;
+  }
+
+  //fill in the duration of a record written with JOURNAL_NO_DURATION
+  void setDuration(uint32_t seq, uint32_t durationMs) {
+    journalRecord record;
+    if (!read(seq, record) || record.durationMs != JOURNAL_NO_DURATION) {
+      return;
+    }
+    record.durationMs = durationMs >= JOURNAL_NO_DURATION ? JOURNAL_NO_DURATION - 1 : durationMs;
+    ESP.flashWrite(recordOffset(seq) + 8, (uint32_t*)&record + 2, 4);
+  }
+
+  //update the delivery result of one backend, when the flash allows it (bits can only be cleared)
+  void setDelivery(uint32_t seq, uint8_t backend, uint8_t delivery) {
+    journalRecord record;
+    if (!read(seq, record) || (FlashJournal::delivery(record, backend) & delivery) != delivery) {
+      return;
+    }
+    record.delivery = withDelivery(record.delivery, backend, delivery);
+    ESP.flashWrite(recordOffset(seq) + 12, (uint32_t*)&record + 3, 4);
+  }
+
+  static uint8_t delivery(const journalRecord &record, uint8_t backend) {
+    return (record.delivery >> (backend * 2)) & 3;
+  }
+
+  //delivery byte with the result of one backend set, start from 0xFF
+  static uint8_t withDelivery(uint8_t deliveries, uint8_t backend, uint8_t delivery) {
+    return deliveries & ~((~delivery & 3) << (backend * 2));
+  }
+};
+
+#endif
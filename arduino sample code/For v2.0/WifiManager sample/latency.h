@@ -0,0 +1,79 @@
+/***************************************************************************
+ Fixed memory latency histogram for the Doorbell modernizr
+
+ Latencies are counted in exponential buckets: bucket 0 holds everything below
+ 500 us, every next bucket doubles the upper bound, the last bucket (16 s and up)
+ holds everything else. Percentiles are reported as the upper bound of the bucket
+ they fall in, so they are accurate to a factor 2 at worst.
+ ***************************************************************************/
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#define LATENCY_BUCKETS 16
+#define LATENCY_BASE_US 500UL
+
+//micros() timestamps of the stages of one message, 0 when the stage was not reached
+struct latencyTrace {
+  uint32_t edgeUs;      //first pulse of the ring
+  uint32_t dispatchUs;  //backend started sending
+  uint32_t connectUs;   //tcp connection up
+  uint32_t writtenUs;   //request or publish written
+  uint32_t responseUs;  //response received
+};
+
+struct LatencyHistogram {
+  uint16_t buckets[LATENCY_BUCKETS] = {0};
+  uint32_t count = 0;
+  uint32_t maxUs = 0;
+
+  static uint32_t bucketLimitUs(uint8_t bucket) {
+    return LATENCY_BASE_US << bucket;
+  }
+
+  void add(uint32_t us) {
+    uint8_t bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= bucketLimitUs(bucket)) {
+      bucket++;
+    }
+    if (buckets[bucket] == 0xFFFF) {
+      //halve everything instead of overflowing, keeps the distribution
+      for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+        buckets[i] /= 2;
+      }
+    }
+    buckets[bucket]++;
+    count++;
+    if (us > maxUs) {
+      maxUs = us;
+    }
+  }
+
+  //upper bound in us of the bucket holding the given percentile, 0 when empty
+  uint32_t percentileUs(uint8_t percentile) const {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      total += buckets[i];
+    }
+    if (total == 0) {
+      return 0;
+    }
+    uint32_t rank = (total * percentile + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS - 1; i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::min(bucketLimitUs(i), maxUs);
+      }
+    }
+    return maxUs;
+  }
+
+  //{"n":..,"p50":..,"p90":..,"p99":..,"max":..}, all in us
+  void format(char *buf, size_t len) const {
+    snprintf(buf, len, "{\"n\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu}",
+             (unsigned long)count, (unsigned long)percentileUs(50), (unsigned long)percentileUs(90),
+             (unsigned long)percentileUs(99), (unsigned long)maxUs);
+  }
+};
+
+#endif
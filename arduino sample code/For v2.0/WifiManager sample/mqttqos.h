@@ -0,0 +1,358 @@
+/***************************************************************************
+ MQTT QoS 1 publishing for the Doorbell modernizr
+
+ PubSubClient only publishes at QoS 0. It stays the transport (connect, keep alive, subscriptions)
+ and QoS 1 is added next to it:
+ - MqttAckClient sits between PubSubClient and the WiFiClient. It passes everything through and
+   follows the framing of the incoming packets, to catch the PUBACKs that PubSubClient skips.
+ - MqttPublisher writes QoS 1 PUBLISH packets on that same connection and keeps them in a small
+   in-flight table keyed by packet id until their PUBACK comes in. A packet that is not acknowledged
+   within MQTT_REDELIVERY_INTERVAL is sent again with the DUP flag, right away after a reconnect;
+   after MQTT_ACK_TIMEOUT it is given up. Untracked publishes (the states sent on a reconnect) use
+   at most MQTT_UNTRACKED_MAX slots, the others are kept for the notifications.
+
+ The time from the first send of a packet to its PUBACK goes into a histogram, ConnectRate counts
+ the connects to the broker over the last hour.
+ ***************************************************************************/
+#ifndef MQTTQOS_H
+#define MQTTQOS_H
+
+#define MQTT_INFLIGHT_SIZE 4
+#define MQTT_UNTRACKED_MAX 2
+#define MQTT_QOS_PACKET_SIZE 224  //fixed header, topic, packet id and payload
+#define MQTT_REDELIVERY_INTERVAL 2000
+#define MQTT_ACK_TIMEOUT 10000
+
+#define MQTT_PACKET_PUBLISH 3
+#define MQTT_PACKET_PUBACK 4
+#define MQTT_FLAG_DUP 0x08
+#define MQTT_FLAG_QOS1 0x02
+#define MQTT_FLAG_RETAIN 0x01
+
+enum mqttDelivery { MQTT_PENDING, MQTT_ACKED, MQTT_EXPIRED };
+
+typedef void (*mqttAckCallback)(uint16_t packetId);
+
+class MqttAckClient : public Client {
+ public:
+  mqttAckCallback onAck = NULL;
+
+  explicit MqttAckClient(Client &transport) : client(&transport) {}
+
+  //switch to another transport, like a tls client, the current connection is closed
+  void use(Client &transport) {
+    if (&transport != client) {
+      stop();
+      client = &transport;
+    }
+  }
+
+  int connect(IPAddress ip, uint16_t port) override {
+    rxState = RX_HEADER;
+    return client->connect(ip, port);
+  }
+
+  int connect(const char *host, uint16_t port) override {
+    rxState = RX_HEADER;
+    return client->connect(host, port);
+  }
+
+  size_t write(uint8_t b) override { return client->write(b); }
+  size_t write(const uint8_t *buf, size_t size) override { return client->write(buf, size); }
+  int available() override { return client->available(); }
+  int peek() override { return client->peek(); }
+  void flush() override { client->flush(); }
+  uint8_t connected() override { return client->connected(); }
+  operator bool() override { return client->connected(); }
+
+  int read() override {
+    int b = client->read();
+    if (b >= 0) {
+      parse(b);
+    }
+    return b;
+  }
+
+  int read(uint8_t *buf, size_t size) override {
+    int len = client->read(buf, size);
+    for (int i = 0; i < len; i++) {
+      parse(buf[i]);
+    }
+    return len;
+  }
+
+  void stop() override {
+    client->stop();
+    rxState = RX_HEADER;
+  }
+
+ private:
+  enum { RX_HEADER, RX_LENGTH, RX_BODY };
+
+  //follow the packet framing, the only packet of interest is a PUBACK: 0x40, 2, packet id
+  void parse(uint8_t b) {
+    switch (rxState) {
+      case RX_HEADER:
+        rxType = b >> 4;
+        rxLength = 0;
+        rxShift = 0;
+        rxId = 0;
+        rxState = RX_LENGTH;
+        break;
+
+      case RX_LENGTH:
+        rxLength |= (uint32_t)(b & 127) << rxShift;
+        rxShift += 7;
+        if ((b & 128) == 0) {
+          rxPos = 0;
+          rxState = rxLength == 0 ? RX_HEADER : RX_BODY;
+        }
+        break;
+
+      case RX_BODY:
+        if (rxPos < 2) {
+          rxId = (rxId << 8) | b;
+        }
+        if (++rxPos == rxLength) {
+          if (rxType == MQTT_PACKET_PUBACK && rxLength == 2 && onAck != NULL) {
+            onAck(rxId);
+          }
+          rxState = RX_HEADER;
+        }
+        break;
+    }
+  }
+
+  Client *client;
+  uint8_t rxState = RX_HEADER;
+  uint8_t rxType = 0;
+  uint8_t rxShift = 0;
+  uint32_t rxLength = 0;
+  uint32_t rxPos = 0;
+  uint16_t rxId = 0;
+};
+
+class MqttPublisher {
+ public:
+  uint32_t published = 0;
+  uint32_t acked = 0;
+  uint32_t redelivered = 0;
+  uint32_t expired = 0;
+  LatencyHistogram ackLatency;
+
+  explicit MqttPublisher(Client &transport) : client(transport) {}
+
+  //write a QoS 1 publish, returns its packet id or 0 when it could not be written. The result of a
+  //tracked publish has to be collected with take(), an untracked one is forgotten when it is done.
+  uint16_t publish(const char *topic, const char *payload, bool retained, bool tracked) {
+    size_t topicLength = strlen(topic);
+    size_t payloadLength = strlen(payload);
+    size_t remaining = 2 + topicLength + 2 + payloadLength;
+    inflightPacket *slot = freeSlot();
+    if (!available(tracked) || remaining + 3 > MQTT_QOS_PACKET_SIZE) {
+      return 0;
+    }
+
+    uint16_t id = nextPacketId();
+    uint8_t *p = slot->packet;
+    *p++ = (MQTT_PACKET_PUBLISH << 4) | MQTT_FLAG_QOS1 | (retained ? MQTT_FLAG_RETAIN : 0);
+    do {
+      uint8_t digit = remaining % 128;
+      remaining /= 128;
+      *p++ = remaining > 0 ? digit | 128 : digit;
+    } while (remaining > 0);
+    *p++ = topicLength >> 8;
+    *p++ = topicLength & 255;
+    memcpy(p, topic, topicLength);
+    p += topicLength;
+    *p++ = id >> 8;
+    *p++ = id & 255;
+    memcpy(p, payload, payloadLength);
+    p += payloadLength;
+    slot->length = p - slot->packet;
+
+    if (client.write(slot->packet, slot->length) != slot->length) {
+      return 0;
+    }
+    slot->packetId = id;
+    slot->state = MQTT_PENDING;
+    slot->tracked = tracked;
+    slot->sentUs = micros();
+    slot->firstMillis = millis();
+    slot->lastMillis = slot->firstMillis;
+    published++;
+    return id;
+  }
+
+  //a PUBACK came in
+  void ack(uint16_t packetId) {
+    inflightPacket *slot = find(packetId);
+    if (slot == NULL || slot->state != MQTT_PENDING) {
+      return;  //a second ack of a redelivered packet
+    }
+    slot->ackUs = micros();
+    ackLatency.add(slot->ackUs - slot->sentUs);
+    acked++;
+    finish(*slot, MQTT_ACKED);
+  }
+
+  //result of a tracked publish, the slot is freed once it is acked or expired
+  uint8_t take(uint16_t packetId, uint32_t &ackUs) {
+    inflightPacket *slot = find(packetId);
+    if (slot == NULL) {
+      return MQTT_EXPIRED;
+    }
+    uint8_t state = slot->state;
+    ackUs = slot->ackUs;
+    if (state != MQTT_PENDING) {
+      slot->packetId = 0;
+    }
+    return state;
+  }
+
+  //redeliver and expire, call from loop()
+  void poll(bool connected) {
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      inflightPacket &slot = inflight[i];
+      if (slot.packetId == 0 || slot.state != MQTT_PENDING) {
+        continue;
+      }
+      if (millis() - slot.firstMillis >= MQTT_ACK_TIMEOUT) {
+        expired++;
+        finish(slot, MQTT_EXPIRED);
+      } else if (connected && millis() - slot.lastMillis >= MQTT_REDELIVERY_INTERVAL) {
+        slot.packet[0] |= MQTT_FLAG_DUP;
+        client.write(slot.packet, slot.length);
+        slot.lastMillis = millis();
+        redelivered++;
+      }
+    }
+  }
+
+  //the connection is new: send everything that is still pending again on the next poll
+  void resend() {
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      inflight[i].lastMillis = millis() - MQTT_REDELIVERY_INTERVAL;
+    }
+  }
+
+  //true when a publish of this kind has a free slot
+  bool available(bool tracked) const {
+    uint8_t untracked = 0;
+    uint8_t used = 0;
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      if (inflight[i].packetId != 0) {
+        used++;
+        untracked += inflight[i].tracked ? 0 : 1;
+      }
+    }
+    return used < MQTT_INFLIGHT_SIZE && (tracked || untracked < MQTT_UNTRACKED_MAX);
+  }
+
+  uint8_t pending() const {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      if (inflight[i].packetId != 0 && inflight[i].state == MQTT_PENDING) {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  //{"published":..,"acked":..,"redelivered":..,"expired":..,"pending":..}
+  void format(char *buf, size_t len) const {
+    snprintf(buf, len, "{\"published\":%lu,\"acked\":%lu,\"redelivered\":%lu,\"expired\":%lu,\"pending\":%u}",
+             (unsigned long)published, (unsigned long)acked, (unsigned long)redelivered, (unsigned long)expired, pending());
+  }
+
+ private:
+  struct inflightPacket {
+    uint16_t packetId;  //0 when the slot is free
+    uint16_t length;
+    uint8_t state;      //mqttDelivery
+    bool tracked;
+    uint32_t sentUs;
+    uint32_t ackUs;
+    unsigned long firstMillis;
+    unsigned long lastMillis;
+    uint8_t packet[MQTT_QOS_PACKET_SIZE];
+  };
+
+  inflightPacket* find(uint16_t packetId) {
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      if (packetId != 0 && inflight[i].packetId == packetId) {
+        return &inflight[i];
+      }
+    }
+    return NULL;
+  }
+
+  inflightPacket* freeSlot() {
+    for (uint8_t i = 0; i < MQTT_INFLIGHT_SIZE; i++) {
+      if (inflight[i].packetId == 0) {
+        return &inflight[i];
+      }
+    }
+    return NULL;
+  }
+
+  void finish(inflightPacket &slot, uint8_t state) {
+    slot.state = state;
+    if (!slot.tracked) {
+      slot.packetId = 0;
+    }
+  }
+
+  //packet ids run from 1 to 65535, skipping the ones still in flight
+  uint16_t nextPacketId() {
+    do {
+      lastPacketId = lastPacketId == 65535 ? 1 : lastPacketId + 1;
+    } while (find(lastPacketId) != NULL);
+    return lastPacketId;
+  }
+
+  Client &client;
+  inflightPacket inflight[MQTT_INFLIGHT_SIZE] = {};
+  uint16_t lastPacketId = 0;
+};
+
+//Connects in the last hour, counted in buckets of 10 minutes
+#define CONNECT_RATE_BUCKETS 6
+#define CONNECT_RATE_BUCKET_MS 600000UL
+
+struct ConnectRate {
+  uint16_t buckets[CONNECT_RATE_BUCKETS] = {0};
+  uint32_t current = 0;  //number of the current bucket since boot
+  uint32_t total = 0;
+
+  void add(uint32_t nowMs) {
+    advance(nowMs);
+    buckets[current % CONNECT_RATE_BUCKETS]++;
+    total++;
+  }
+
+  uint32_t lastHour(uint32_t nowMs) {
+    advance(nowMs);
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < CONNECT_RATE_BUCKETS; i++) {
+      sum += buckets[i];
+    }
+    return sum;
+  }
+
+ private:
+  //clear the buckets that have passed, all of them after a long time or when millis() wrapped
+  void advance(uint32_t nowMs) {
+    uint32_t bucket = nowMs / CONNECT_RATE_BUCKET_MS;
+    if (bucket - current >= CONNECT_RATE_BUCKETS) {
+      memset(buckets, 0, sizeof(buckets));
+      current = bucket;
+    }
+    while (current != bucket) {
+      current++;
+      buckets[current % CONNECT_RATE_BUCKETS] = 0;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,119 @@
+/***************************************************************************
+ Queue of undelivered messages for the Doorbell modernizr
+
+ A message that could not be delivered to a backend is kept here with the sequence number
+ and timestamp of the event it belongs to, and replayed in order when the backend is back.
+ The queue is bounded: when it is full the oldest message is dropped (it stays in the journal
+ as failed).
+
+ The queue can be mirrored to the rtc user memory, which survives a soft reset (not a power
+ cycle). The first 128 bytes of the rtc user memory are used by the OTA updater, the queue
+ is stored after them.
+ ***************************************************************************/
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#define OUTBOX_SIZE 16
+#define OUTBOX_RTC_OFFSET 32  //in 4 byte blocks
+#define OUTBOX_MAGIC 0x584F424FUL  //"OBOX"
+
+enum outboxKind { OUTBOX_RING, OUTBOX_PRESS, OUTBOX_OFF };
+
+struct outboxEntry {
+  uint32_t seq;         //journal sequence number of the event
+  uint32_t uptimeMs;    //millis() at the event
+  uint16_t boot;        //boot the event happened in
+  uint16_t durationMs;  //press duration
+  uint8_t kind;         //outboxKind
+  uint8_t channel;
+  uint8_t backend;
+  uint8_t detail;       //press type
+  uint8_t count;        //rings in the press
+  uint8_t reserved[3];
+};
+
+struct outboxData {
+  uint32_t magic;
+  uint32_t checksum;
+  uint32_t count;
+  outboxEntry entries[OUTBOX_SIZE];
+};
+
+struct Outbox {
+  outboxData data;
+  bool mirrored = false;
+  uint32_t dropped = 0;
+
+  static uint32_t checksumOf(const uint8_t *bytes, size_t len) {
+    uint32_t sum = 0x811C9DC5UL;  //FNV-1a
+    for (size_t i = 0; i < len; i++) {
+      sum = (sum ^ bytes[i]) * 0x01000193UL;
+    }
+    return sum;
+  }
+
+  uint32_t checksum() const {
+    return checksumOf((const uint8_t*)&data.count, sizeof(data) - offsetof(outboxData, count));
+  }
+
+  //start empty, or with the queue left in rtc memory by the previous boot when mirrored
+  void begin(bool mirror) {
+    mirrored = mirror;
+    if (!mirrored || !ESP.rtcUserMemoryRead(OUTBOX_RTC_OFFSET, (uint32_t*)&data, sizeof(data)) ||
+        data.magic != OUTBOX_MAGIC || data.count > OUTBOX_SIZE || data.checksum != checksum()) {
+      data.count = 0;
+    }
+    save();
+  }
+
+  void save() {
+    if (!mirrored) {
+      return;
+    }
+    data.magic = OUTBOX_MAGIC;
+    data.checksum = checksum();
+    ESP.rtcUserMemoryWrite(OUTBOX_RTC_OFFSET, (uint32_t*)&data, sizeof(data));
+  }
+
+  uint8_t size() const {
+    return data.count;
+  }
+
+  void push(const outboxEntry &entry) {
+    if (data.count == OUTBOX_SIZE) {
+      dropped++;
+      remove(0);
+    }
+    data.entries[data.count++] = entry;
+    save();
+  }
+
+  //index of the oldest message of a backend, -1 when there is none
+  int first(uint8_t backend) const {
+    for (uint8_t i = 0; i < data.count; i++) {
+      if (data.entries[i].backend == backend) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  //remove a message that has been sent again, when it is still queued
+  void removeMessage(const outboxEntry &entry) {
+    for (uint8_t i = 0; i < data.count; i++) {
+      const outboxEntry &queued = data.entries[i];
+      if (queued.backend == entry.backend && queued.seq == entry.seq && queued.kind == entry.kind) {
+        remove(i);
+        return;
+      }
+    }
+  }
+
+  void remove(uint8_t index) {
+    memmove(&data.entries[index], &data.entries[index + 1], (data.count - index - 1) * sizeof(outboxEntry));
+    data.count--;
+    save();
+  }
+};
+
+#endif
@@ -0,0 +1,89 @@
+/***************************************************************************
+ Press classification for the Doorbell modernizr
+
+ Takes the rings from the ring detector and turns them into press events:
+ - short:  one ring shorter than the long press time
+ - long:   one ring of at least the long press time
+ - double: two rings, each started within the multi ring window after the previous one ended
+ - multi:  three or more rings like that
+
+ PRESS_BURST is not produced here, it is the summary of a burst of presses (see coalescer.h).
+
+ A press event is only known once the multi ring window after the last ring has passed,
+ the 'on' messages do not wait for it.
+ ***************************************************************************/
+#ifndef PRESSCLASSIFIER_H
+#define PRESSCLASSIFIER_H
+
+enum pressType { PRESS_SHORT, PRESS_LONG, PRESS_DOUBLE, PRESS_MULTI, PRESS_BURST };
+
+struct pressEvent {
+  uint8_t type;
+  uint8_t count;        //number of rings in this press
+  uint32_t durationMs;  //held time, summed over all rings
+};
+
+const char* pressTypeName(uint8_t type) {
+  switch (type) {
+    case PRESS_SHORT:  return "short";
+    case PRESS_LONG:   return "long";
+    case PRESS_DOUBLE: return "double";
+    case PRESS_MULTI:  return "multi";
+    case PRESS_BURST:  return "burst";
+  }
+  return "unknown";
+}
+
+struct PressClassifier {
+  uint32_t longPressUs = 1000000;
+  uint32_t multiWindowUs = 600000;
+
+  bool ringing = false;
+  uint8_t count = 0;
+  uint32_t durationUs = 0;
+  uint32_t lastEndUs = 0;
+
+  void configure(unsigned longPressMs, unsigned multiWindowMs) {
+    longPressUs = longPressMs * 1000UL;
+    multiWindowUs = multiWindowMs * 1000UL;
+  }
+
+  void ringStarted() {
+    ringing = true;
+  }
+
+  void ringEnded(uint32_t startUs, uint32_t endUs) {
+    ringing = false;
+    if (count < 255) {
+      count++;
+    }
+    durationUs += endUs - startUs;
+    lastEndUs = endUs;
+  }
+
+  //true while a press is still being classified
+  bool busy() const {
+    return ringing || count != 0;
+  }
+
+  //returns true and fills event once a press is complete
+  bool poll(uint32_t nowUs, pressEvent &event) {
+    if (count == 0 || ringing || nowUs - lastEndUs < multiWindowUs) {
+      return false;
+    }
+    event.count = count;
+    event.durationMs = durationUs / 1000;
+    if (count >= 3) {
+      event.type = PRESS_MULTI;
+    } else if (count == 2) {
+      event.type = PRESS_DOUBLE;
+    } else {
+      event.type = durationUs >= longPressUs ? PRESS_LONG : PRESS_SHORT;
+    }
+    count = 0;
+    durationUs = 0;
+    return true;
+  }
+};
+
+#endif
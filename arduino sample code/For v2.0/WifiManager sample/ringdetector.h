@@ -0,0 +1,136 @@
+/***************************************************************************
+ Ring detector for the Doorbell modernizr doorbell input
+
+ The doorbell voltage (8 - 24v ac) goes through a bridge rectifier and the PC817
+ optocoupler into the input pin. While the doorbell is pressed the input does not
+ stay low, it pulses low at 100/120 Hz. Noise on the line gives single spikes.
+
+ A ring is recognised by the presence of a pulse train: at least minPulses falling
+ edges within the window, each no further apart than one period of the minimum
+ frequency. The ring ends when no pulse has been seen for the silence gap. An input
+ that is held low (dc doorbell) counts as a continuous pulse train.
+
+ All timestamps are micros() values, differences are wrap safe. edge() and poll()
+ are called from the sample timer interrupt and are kept in IRAM.
+ ***************************************************************************/
+#ifndef RINGDETECTOR_H
+#define RINGDETECTOR_H
+
+enum ringEvent { RING_NONE, RING_STARTED, RING_ENDED };
+
+struct RingDetector {
+  enum { IDLE, ARMING, RINGING };
+
+  //settings, see configure()
+  uint32_t maxPeriodUs = 25000;
+  uint8_t minPulses = 3;
+  uint32_t windowUs = 100000;
+  uint32_t gapUs = 200000;
+
+  uint8_t state = IDLE;
+  int level = HIGH;
+  uint8_t pulses = 0;
+  uint32_t firstPulseUs = 0;
+  uint32_t lastPulseUs = 0;
+
+  //result of the last RING_STARTED / RING_ENDED
+  uint32_t startUs = 0;
+  uint32_t endUs = 0;
+
+  void configure(unsigned minFrequency, unsigned pulseCount, unsigned windowMs, unsigned gapMs) {
+    maxPeriodUs = 1000000UL / (minFrequency > 0 ? minFrequency : 1);
+    minPulses = pulseCount > 0 ? pulseCount : 1;
+    windowUs = windowMs * 1000UL;
+    gapUs = gapMs * 1000UL;
+  }
+
+  void reset(int currentLevel) {
+    state = IDLE;
+    level = currentLevel;
+    pulses = 0;
+  }
+
+  //feed a captured edge, newLevel is the input level right after the edge
+  ICACHE_RAM_ATTR ringEvent edge(uint32_t us, int newLevel) {
+    if (newLevel == level) {
+      return RING_NONE;  //no real change, contact bounce or a missed edge
+    }
+    level = newLevel;
+    if (level != LOW) {
+      return RING_NONE;  //only the start of a pulse counts
+    }
+
+    switch (state) {
+      case IDLE:
+        return startArming(us);
+
+      case ARMING:
+        if (us - lastPulseUs > maxPeriodUs || us - firstPulseUs > windowUs) {
+          return startArming(us);  //too slow for a pulse train, start counting again from this pulse
+        }
+        pulses++;
+        lastPulseUs = us;
+        if (pulses >= minPulses) {
+          state = RINGING;
+          startUs = firstPulseUs;
+          return RING_STARTED;
+        }
+        break;
+
+      case RINGING:
+        lastPulseUs = us;
+        break;
+    }
+    return RING_NONE;
+  }
+
+  //check the timeouts, call after all captured edges have been fed
+  ICACHE_RAM_ATTR ringEvent poll(uint32_t nowUs, int currentLevel) {
+    if (currentLevel == LOW && level == LOW) {
+      //held low, treat as a continuous pulse train
+      if (state == ARMING && nowUs - firstPulseUs >= windowUs) {
+        state = RINGING;
+        startUs = firstPulseUs;
+        lastPulseUs = nowUs;
+        return RING_STARTED;
+      }
+      if (state == RINGING) {
+        lastPulseUs = nowUs;
+      }
+      return RING_NONE;
+    }
+
+    if (state == ARMING && nowUs - lastPulseUs > maxPeriodUs) {
+      state = IDLE;  //a spike, not a ring
+    } else if (state == RINGING && nowUs - lastPulseUs > gapUs) {
+      state = IDLE;
+      endUs = lastPulseUs;
+      return RING_ENDED;
+    }
+    return RING_NONE;
+  }
+
+  bool ringing() const {
+    return state == RINGING;
+  }
+
+  //true when no ring is being detected
+  bool idle() const {
+    return state == IDLE;
+  }
+
+  ICACHE_RAM_ATTR ringEvent startArming(uint32_t us) {
+    state = ARMING;
+    pulses = 1;
+    firstPulseUs = us;
+    lastPulseUs = us;
+    if (minPulses <= 1) {
+      state = RINGING;
+      startUs = us;
+      return RING_STARTED;
+    }
+    return RING_NONE;
+  }
+};
+
+#endif
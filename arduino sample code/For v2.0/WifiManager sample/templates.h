@@ -0,0 +1,261 @@
+/***************************************************************************
+ Pre-rendered notification requests for the Doorbell modernizr
+
+ Everything in a request that only depends on the settings (the Domoticz url of a channel, the
+ base64 credentials, the host and other headers, the openHAB item url, the mqtt event topic) is
+ rendered once into fixed buffers when the settings are loaded or saved. Sending a message then
+ only copies these pieces and the few bytes that differ per message into the request buffer of
+ the backend, without a single heap allocation.
+
+ A PayloadTemplate is text with placeholders such as {event} or {seq}. It is parsed once, when the
+ settings are loaded or saved, into a list of segments: runs of literal text and fields. Rendering
+ it for a message copies the segments in order. Braces that do not enclose a known field name (as
+ in a json body) are literal text.
+
+ The ring path is checked for allocations by default: the free heap is compared before and after
+ the logging and display of a ring, a folded ring and a ring end, the rendering of every message
+ and the journal record, and the bytes found allocated are logged and reported on /metrics.
+ Sending is not checked, a new connection allocates. Build with ALLOC_CHECK 0 to leave the check out.
+ ***************************************************************************/
+#ifndef TEMPLATES_H
+#define TEMPLATES_H
+
+#ifndef ALLOC_CHECK
+#define ALLOC_CHECK 1
+#endif
+
+//Free heap comparison over code that must not allocate, nothing with ALLOC_CHECK 0
+struct AllocCheck {
+  uint32_t allocatedBytes = 0;
+
+  uint32_t start() {
+#if ALLOC_CHECK
+    return ESP.getFreeHeap();
+#else
+    return 0;
+#endif
+  }
+
+  void stop(uint32_t freeHeap, const char *what) {
+#if ALLOC_CHECK
+    int32_t allocated = freeHeap - ESP.getFreeHeap();
+    if (allocated > 0) {
+      Serial.print("ALLOC_CHECK: ");
+      Serial.print(what);
+      Serial.print(" allocated ");
+      Serial.print(allocated);
+      Serial.println(" bytes");
+      allocatedBytes += allocated;
+    }
+#endif
+  }
+};
+
+//Text in a caller supplied buffer. Appending never allocates: what does not fit is cut off and
+//the buffer is marked as overflowed, so a truncated request is never sent.
+class TextBuffer {
+ public:
+  TextBuffer(char *buffer, size_t size) : text(buffer), capacity(size) {
+    clear();
+  }
+
+  void clear() {
+    used = 0;
+    overflow = false;
+    text[0] = 0;
+  }
+
+  const char* c_str() const { return text; }
+  size_t length() const { return used; }
+  bool overflowed() const { return overflow; }
+
+  TextBuffer& add(const char *s, size_t len) {
+    if (used + len >= capacity) {
+      len = capacity - 1 - used;
+      overflow = true;
+    }
+    memcpy(text + used, s, len);
+    used += len;
+    text[used] = 0;
+    return *this;
+  }
+
+  TextBuffer& add(const char *s) {
+    return add(s, strlen(s));
+  }
+
+  //text that was cut off is still cut off in here
+  TextBuffer& add(const TextBuffer &other) {
+    add(other.text, other.used);
+    overflow |= other.overflow;
+    return *this;
+  }
+
+  TextBuffer& addNumber(unsigned long value) {
+    return addf("%lu", value);
+  }
+
+  TextBuffer& addf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text + used, capacity - used, format, args);
+    va_end(args);
+    if (len < 0 || used + len >= capacity) {
+      used = capacity - 1;
+      overflow = true;
+    } else {
+      used += len;
+    }
+    return *this;
+  }
+
+  TextBuffer& addBase64(const char *s) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t len = strlen(s);
+    for (size_t i = 0; i < len; i += 3) {
+      uint32_t group = (uint8_t)s[i] << 16;
+      if (i + 1 < len) group |= (uint8_t)s[i + 1] << 8;
+      if (i + 2 < len) group |= (uint8_t)s[i + 2];
+      char quad[4] = {digits[(group >> 18) & 63], digits[(group >> 12) & 63],
+                      i + 1 < len ? digits[(group >> 6) & 63] : '=', i + 2 < len ? digits[group & 63] : '='};
+      add(quad, 4);
+    }
+    return *this;
+  }
+
+ private:
+  char *text;
+  size_t capacity;
+  size_t used;
+  bool overflow;
+};
+
+template <size_t SIZE>
+class FixedText : public TextBuffer {
+ public:
+  FixedText() : TextBuffer(storage, SIZE) {}
+  FixedText(const FixedText&) = delete;
+  FixedText& operator=(const FixedText&) = delete;
+
+ private:
+  char storage[SIZE];
+};
+
+//The fields a PayloadTemplate can hold
+enum templateField {
+  FIELD_TEXT, FIELD_EVENT, FIELD_STATE, FIELD_CHANNEL, FIELD_COUNT, FIELD_DURATION,
+  FIELD_SEQ, FIELD_BOOT, FIELD_UPTIME, FIELD_REPLAY, FIELD_COUNT_
+};
+
+const char* const templateFieldNames[FIELD_COUNT_] = {
+  "", "event", "state", "channel", "count", "duration", "seq", "boot", "uptime", "replay"
+};
+
+//the values of the fields for one message
+struct templateValues {
+  const char *event;  //ring, off or the press type
+  const char *state;  //on, off, or empty for an event
+  uint32_t channel;
+  uint32_t count;
+  uint32_t duration;
+  uint32_t seq;
+  uint32_t boot;
+  uint32_t uptime;
+  bool replay;
+};
+
+#define TEMPLATE_MAX_SEGMENTS 24
+
+class PayloadTemplate {
+ public:
+  //parse the text, which has to stay in place. Returns false when it has too many segments.
+  bool compile(const char *text) {
+    source = text;
+    count = 0;
+    size_t literal = 0;  //start of the current run of literal text
+    size_t i = 0;
+    while (text[i] != 0) {
+      uint8_t field = text[i] == '{' ? fieldAt(text + i + 1) : (uint8_t)FIELD_TEXT;
+      if (field == FIELD_TEXT) {
+        i++;
+        continue;
+      }
+      if (!addSegment(FIELD_TEXT, literal, i - literal)) {
+        return false;
+      }
+      if (!addSegment(field, 0, 0)) {
+        return false;
+      }
+      i += strlen(templateFieldNames[field]) + 2;
+      literal = i;
+    }
+    return addSegment(FIELD_TEXT, literal, i - literal);
+  }
+
+  void render(TextBuffer &out, const templateValues &values) const {
+    for (uint8_t i = 0; i < count; i++) {
+      const segment &s = segments[i];
+      switch (s.field) {
+        case FIELD_TEXT:     out.add(source + s.offset, s.length); break;
+        case FIELD_EVENT:    out.add(values.event); break;
+        case FIELD_STATE:    out.add(values.state); break;
+        case FIELD_CHANNEL:  out.addNumber(values.channel); break;
+        case FIELD_COUNT:    out.addNumber(values.count); break;
+        case FIELD_DURATION: out.addNumber(values.duration); break;
+        case FIELD_SEQ:      out.addNumber(values.seq); break;
+        case FIELD_BOOT:     out.addNumber(values.boot); break;
+        case FIELD_UPTIME:   out.addNumber(values.uptime); break;
+        case FIELD_REPLAY:   out.add(values.replay ? "true" : "false"); break;
+      }
+    }
+  }
+
+ private:
+  struct segment {
+    uint8_t field;    //templateField
+    uint8_t length;   //of the literal text
+    uint16_t offset;  //of the literal text in the source
+  };
+
+  //the field whose name and closing brace start at text, FIELD_TEXT when there is none
+  static uint8_t fieldAt(const char *text) {
+    for (uint8_t field = FIELD_TEXT + 1; field < FIELD_COUNT_; field++) {
+      size_t len = strlen(templateFieldNames[field]);
+      if (strncmp(text, templateFieldNames[field], len) == 0 && text[len] == '}') {
+        return field;
+      }
+    }
+    return FIELD_TEXT;
+  }
+
+  bool addSegment(uint8_t field, size_t offset, size_t length) {
+    while (field == FIELD_TEXT && length > 255) {
+      if (!addSegment(FIELD_TEXT, offset, 255)) {
+        return false;
+      }
+      offset += 255;
+      length -= 255;
+    }
+    if (field == FIELD_TEXT && length == 0) {
+      return true;
+    }
+    if (count == TEMPLATE_MAX_SEGMENTS) {
+      return false;
+    }
+    segments[count++] = {field, (uint8_t)length, (uint16_t)offset};
+    return true;
+  }
+
+  const char *source = "";
+  segment segments[TEMPLATE_MAX_SEGMENTS];
+  uint8_t count = 0;
+};
+
+//the parts of the requests of one channel
+struct channelRequests {
+  FixedText<48> mqttEventTopic;  //<topic>/event
+  FixedText<64> domoticzState;   //GET url of udevice up to the nvalue
+  FixedText<64> openhabItem;     //POST /rest/items/<itemId>
+};
+
+#endif
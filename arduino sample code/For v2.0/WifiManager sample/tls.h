@@ -0,0 +1,106 @@
+/***************************************************************************
+ TLS connections for the Doorbell modernizr
+
+ A PinnedTlsClient is a BearSSL client (esp8266 core 2.5 or later) that is made to keep the
+ handshake short on the ring path:
+ - the server certificate is checked against a configured SHA1 fingerprint only, there is no
+   chain validation;
+ - the session is kept, so a reconnect resumes it with an abbreviated handshake when the server
+   allows it;
+ - the maximum fragment length is negotiated down to TLS_MFLN_SIZE, so the receive buffer is
+   512 bytes instead of 16K. Whether the server supports it is probed once per address and port.
+
+ The handshakes are timed into a histogram. It connects by address, without SNI: servers that
+ need the name to pick their certificate are not supported.
+
+ BearSSL takes tens of KB of flash, more than the 512K layout leaves below the journal (see
+ journal.h), so TLS is only built in with TLS_SUPPORT 1. Without it the fingerprints are ignored
+ and every connection is plain tcp.
+ ***************************************************************************/
+#ifndef TLS_H
+#define TLS_H
+
+#ifndef TLS_SUPPORT
+#define TLS_SUPPORT 0
+#endif
+
+#if TLS_SUPPORT
+
+#define TLS_MFLN_SIZE 512
+#define TLS_RECORD_SIZE 16384
+
+class PinnedTlsClient : public BearSSL::WiFiClientSecure {
+ public:
+  uint32_t handshakes = 0;
+  uint32_t failures = 0;
+  LatencyHistogram handshakeLatency;
+
+  PinnedTlsClient() {
+    setSession(&session);
+  }
+
+  //pin the certificate with its fingerprint, like "AB:CD:..." (spaces or colons between the bytes).
+  //Returns false when it is not valid, nothing is connected to then.
+  bool configure(const char *fingerprint) {
+    pinned = setFingerprint(fingerprint);
+    session = BearSSL::Session();
+    probedPort = 0;
+    return pinned;
+  }
+
+  int connect(IPAddress ip, uint16_t port) override {
+    if (!pinned) {
+      failures++;
+      return 0;
+    }
+    if (ip != probedAddress || port != probedPort) {
+      mfln = probeMaxFragmentLength(ip, port, TLS_MFLN_SIZE);
+      probedAddress = ip;
+      probedPort = port;
+      if (!mfln) {
+        Serial.println("tls server does not support a smaller fragment length, using 16K buffers");
+      }
+    }
+    setBufferSizes(mfln ? TLS_MFLN_SIZE : TLS_RECORD_SIZE, TLS_MFLN_SIZE);
+    uint32_t startUs = micros();
+    if (!BearSSL::WiFiClientSecure::connect(ip, port)) {
+      char error[64];
+      getLastSSLError(error, sizeof(error));
+      Serial.print("tls connection failed: ");
+      Serial.println(error);
+      failures++;
+      return 0;
+    }
+    handshakeLatency.add(micros() - startUs);
+    handshakes++;
+    return 1;
+  }
+
+  int connect(const char *host, uint16_t port) override {
+    IPAddress ip;
+    if (WiFi.hostByName(host, ip) != 1) {
+      failures++;
+      return 0;
+    }
+    return connect(ip, port);
+  }
+
+  //{"handshakes":..,"failures":..,"mfln":..,"handshake":{latency histogram}}
+  void format(char *buf, size_t len) const {
+    char latency[96];
+    handshakeLatency.format(latency, sizeof(latency));
+    snprintf(buf, len, "{\"handshakes\":%lu,\"failures\":%lu,\"mfln\":%s,\"handshake\":%s}",
+             (unsigned long)handshakes, (unsigned long)failures, probedPort == 0 ? "null" : mfln ? "true" : "false", latency);
+  }
+
+ private:
+  BearSSL::Session session;
+  bool pinned = false;
+  bool mfln = false;
+  IPAddress probedAddress;
+  uint16_t probedPort = 0;  //0: not probed yet
+};
+
+#endif
+
+#endif
@@ -0,0 +1,211 @@
+/***************************************************************************
+ LAN datagrams for the Doorbell modernizr
+
+ A ring or press is also sent as one small udp datagram to a multicast group or a list of
+ addresses, for chimes and dashboards on the local network: no connection, no handshake, no
+ acknowledgement. To make up for a lost datagram, every event is sent `copies` times, the first
+ copy right away and the others UDP_COPY_INTERVAL apart from loop(). All copies carry the same
+ device, boot and datagram number, so a receiver acts on the first one and drops the rest.
+
+ The datagram number counts the events sent as datagrams since boot, a gap in it is an event that
+ was lost. The journal sequence number is there to match the event with the journal and the other
+ backends; it has gaps of its own (folded rings, journal only records).
+
+ The datagram is 36 bytes, numbers in network byte order:
+   0  "DBMZ"      4  version (2)   5  kind (0 ring, 1 press)   6  channel (1 based)
+   7  copy (0 based)               8  copies                   9  press type   10  rings in the press
+  11  reserved   12  journal sequence number   16  boot   18  press duration in ms   20  uptime in ms
+  24  chip id    28  us from the first pulse to this copy (0 for a press)   32  datagram number
+ tools/udp_listener.py receives and measures them.
+ ***************************************************************************/
+#ifndef UDPNOTIFY_H
+#define UDPNOTIFY_H
+
+#include <WiFiUdp.h>
+
+#define UDP_MAX_TARGETS 4
+#define UDP_MAX_COPIES 5
+#define UDP_COPY_INTERVAL 20
+#define UDP_QUEUE_SIZE 4
+#define UDP_DATAGRAM_SIZE 36
+#define UDP_VERSION 2
+#define UDP_MULTICAST_TTL 1
+
+enum udpKind { UDP_RING, UDP_PRESS };
+
+struct udpEvent {
+  uint8_t kind;  //udpKind
+  uint8_t channel;
+  uint8_t pressType;
+  uint8_t count;
+  uint32_t seq;
+  uint16_t boot;
+  uint16_t durationMs;
+  uint32_t uptimeMs;
+  uint32_t edgeUs;  //micros() at the first pulse of a ring, 0 for a press
+};
+
+struct UdpNotifier {
+  IPAddress targets[UDP_MAX_TARGETS];
+  uint8_t targetCount = 0;
+  uint16_t port = 0;
+  uint8_t copies = 1;
+
+  uint32_t events = 0;
+  uint32_t sent = 0;
+  uint32_t failed = 0;
+  uint32_t dropped = 0;  //copies not sent because a newer event needed the slot
+  uint32_t nextNumber = 1;  //datagram number of the next event
+
+  //parse "239.255.42.99" or "192.168.1.10,192.168.1.11", returns false when an address is wrong.
+  //No targets is no datagrams.
+  bool configure(const char *list, uint16_t toPort, uint8_t toCopies) {
+    targetCount = 0;
+    port = toPort;
+    copies = constrain(toCopies, 1, UDP_MAX_COPIES);
+    for (uint8_t i = 0; i < UDP_QUEUE_SIZE; i++) {
+      queue[i].copiesLeft = 0;
+    }
+    char address[16];
+    for (const char *item = list; *item != 0; ) {
+      const char *end = strchr(item, ',');
+      size_t len = end != NULL ? end - item : strlen(item);
+      while (len > 0 && isspace(*item)) {
+        item++;
+        len--;
+      }
+      while (len > 0 && isspace(item[len - 1])) {
+        len--;
+      }
+      if (len > 0) {
+        if (len >= sizeof(address) || targetCount == UDP_MAX_TARGETS) {
+          return false;
+        }
+        memcpy(address, item, len);
+        address[len] = 0;
+        if (!targets[targetCount].fromString(address)) {
+          return false;
+        }
+        targetCount++;
+      }
+      item = end != NULL ? end + 1 : item + strlen(item);
+    }
+    return true;
+  }
+
+  bool enabled() const {
+    return targetCount != 0 && port != 0;
+  }
+
+  //send the first copy of an event now and queue the others
+  void notify(const udpEvent &event) {
+    if (!enabled()) {
+      return;
+    }
+    events++;
+    pendingEvent *slot = &queue[0];
+    for (uint8_t i = 0; i < UDP_QUEUE_SIZE; i++) {
+      if (queue[i].copiesLeft == 0) {
+        slot = &queue[i];
+        break;
+      }
+      if ((long)(queue[i].nextMillis - slot->nextMillis) < 0) {
+        slot = &queue[i];  //the oldest one
+      }
+    }
+    dropped += slot->copiesLeft;
+    slot->event = event;
+    slot->number = nextNumber++;
+    slot->copy = 0;
+    slot->copiesLeft = copies;
+    sendCopy(*slot);
+  }
+
+  //send the copies that are due, call from loop()
+  void poll() {
+    for (uint8_t i = 0; i < UDP_QUEUE_SIZE; i++) {
+      if (queue[i].copiesLeft != 0 && (long)(millis() - queue[i].nextMillis) >= 0) {
+        sendCopy(queue[i]);
+      }
+    }
+  }
+
+  bool busy() const {
+    for (uint8_t i = 0; i < UDP_QUEUE_SIZE; i++) {
+      if (queue[i].copiesLeft != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  //{"targets":..,"copies":..,"events":..,"sent":..,"failed":..,"dropped":..}
+  void format(char *buf, size_t len) const {
+    snprintf(buf, len, "{\"targets\":%u,\"copies\":%u,\"events\":%lu,\"sent\":%lu,\"failed\":%lu,\"dropped\":%lu}",
+             targetCount, copies, (unsigned long)events, (unsigned long)sent, (unsigned long)failed, (unsigned long)dropped);
+  }
+
+ private:
+  struct pendingEvent {
+    udpEvent event;
+    uint32_t number;
+    uint8_t copy;
+    uint8_t copiesLeft;
+    unsigned long nextMillis;
+  };
+
+  static uint8_t* put16(uint8_t *p, uint16_t value) {
+    *p++ = value >> 8;
+    *p++ = value & 255;
+    return p;
+  }
+
+  static uint8_t* put32(uint8_t *p, uint32_t value) {
+    return put16(put16(p, value >> 16), value & 0xFFFF);
+  }
+
+  static bool multicast(const IPAddress &address) {
+    return address[0] >= 224 && address[0] <= 239;
+  }
+
+  void sendCopy(pendingEvent &pending) {
+    const udpEvent &e = pending.event;
+    uint8_t datagram[UDP_DATAGRAM_SIZE];
+    uint8_t *p = datagram;
+    memcpy(p, "DBMZ", 4);
+    p += 4;
+    *p++ = UDP_VERSION;
+    *p++ = e.kind;
+    *p++ = e.channel + 1;
+    *p++ = pending.copy;
+    *p++ = copies;
+    *p++ = e.pressType;
+    *p++ = e.count;
+    *p++ = 0;
+    p = put32(p, e.seq);
+    p = put16(p, e.boot);
+    p = put16(p, e.durationMs);
+    p = put32(p, e.uptimeMs);
+    p = put32(p, ESP.getChipId());
+    p = put32(p, e.edgeUs != 0 ? micros() - e.edgeUs : 0);
+    put32(p, pending.number);
+
+    for (uint8_t i = 0; i < targetCount; i++) {
+      bool begun = multicast(targets[i]) ? udp.beginPacketMulticast(targets[i], port, WiFi.localIP(), UDP_MULTICAST_TTL)
+                                         : udp.beginPacket(targets[i], port);
+      if (begun && udp.write(datagram, sizeof(datagram)) == sizeof(datagram) && udp.endPacket()) {
+        sent++;
+      } else {
+        failed++;
+      }
+    }
+    pending.copy++;
+    pending.copiesLeft--;
+    pending.nextMillis = millis() + UDP_COPY_INTERVAL;
+  }
+
+  WiFiUDP udp;
+  pendingEvent queue[UDP_QUEUE_SIZE] = {};
+};
+
+#endif
@@ -52,9 +52,13 @@ void reconnect() {
   while (!client.connected()) {
     Serial.print("Attempting MQTT connection...");
     // Attempt to connect
+    // The client id has to be unique on the broker, else the doorbells keep kicking each other off
+    // (the same id as the WifiManager sample gives the device)
+    char clientId[24];
+    snprintf(clientId, sizeof(clientId), "doorbell-modernizr-%06x", ESP.getChipId());
     // If you do not want to use a username and password, change next line to
-    // if (client.connect("ESP8266Client")) {
-    if (client.connect("ESP8266Client", mqtt_user, mqtt_password)) {
+    // if (client.connect(clientId)) {
+    if (client.connect(clientId, mqtt_user, mqtt_password)) {
       Serial.println("connected");
     } else {
       Serial.print("failed, rc=");
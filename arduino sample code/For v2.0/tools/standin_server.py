@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Stand-in Domoticz / openHAB server for measuring the doorbell modernizr requests.
+
+Point the doorbell at the computer running this script (ip address and port on the
+configuration page) and ring. Every request is answered like Domoticz ({"status":"OK"})
+or openHAB (200, empty body) would, over a keep-alive connection, and a line is printed
+with:
+
+  reads     number of recv() calls it took to get the whole request, roughly the number
+            of tcp segments it was sent in (use tcpdump for the exact count)
+  last byte time from the first to the last byte of the request
+
+Ctrl-C prints the averages. Compare a run with tcp nodelay on and off, or against an
+older sketch version that printed the request line by line.
+
+usage: standin_server.py [port]   (default 8080)
+"""
+import socket
+import sys
+import threading
+import time
+
+stats = {"requests": 0, "reads": 0, "last_byte": 0.0}
+lock = threading.Lock()
+
+
+def read_request(conn, pending):
+    """Read one request, returns (request bytes, reads, first to last byte seconds, rest)."""
+    data = pending
+    reads = 0
+    first = time.monotonic() if data else None
+    last = first
+    while True:
+        end = data.find(b"\r\n\r\n")
+        if end >= 0:
+            length = 0
+            for line in data[:end].split(b"\r\n")[1:]:
+                name, _, value = line.partition(b":")
+                if name.strip().lower() == b"content-length":
+                    length = int(value.strip())
+            total = end + 4 + length
+            if len(data) >= total:
+                return data[:total], reads, last - first, data[total:]
+        chunk = conn.recv(4096)
+        if not chunk:
+            return None, reads, 0, b""
+        reads += 1
+        last = time.monotonic()
+        if first is None:
+            first = last
+        data += chunk
+
+
+def serve(conn, address):
+    pending = b""
+    with conn:
+        while True:
+            request, reads, last_byte, pending = read_request(conn, pending)
+            if request is None:
+                return
+            line = request.split(b"\r\n", 1)[0].decode(errors="replace")
+            if line.startswith("GET /json.htm"):
+                body = b'{\n   "status" : "OK",\n   "title" : "Update Device"\n}\n'
+            else:
+                body = b""
+            conn.sendall(b"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n"
+                         b"Connection: keep-alive\r\n\r\n%s" % (len(body), body))
+            with lock:
+                stats["requests"] += 1
+                stats["reads"] += reads
+                stats["last_byte"] += last_byte
+            print("%s  %d bytes  reads %d  last byte %.1f ms  %s"
+                  % (address[0], len(request), reads, last_byte * 1000, line[:80]))
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8080
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(("", port))
+    listener.listen(4)
+    print("listening on port %d" % port)
+    try:
+        while True:
+            conn, address = listener.accept()
+            threading.Thread(target=serve, args=(conn, address), daemon=True).start()
+    except KeyboardInterrupt:
+        with lock:
+            n = stats["requests"]
+            if n:
+                print("\n%d requests, %.2f reads per request, last byte %.2f ms on average"
+                      % (n, stats["reads"] / n, stats["last_byte"] * 1000 / n))
+
+
+if __name__ == "__main__":
+    main()
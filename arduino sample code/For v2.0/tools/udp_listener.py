@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Listener for the doorbell modernizr lan datagrams.
+
+Enter the ip address of this computer, or a multicast group such as 239.255.42.99, as the
+udp target on the configuration page and ring. Every event is printed once, when its first
+copy arrives, with:
+
+  detect   us from the first pulse of the ring to the first copy leaving the doorbell,
+           as measured by the doorbell itself
+  copies   copies received out of the copies sent, the others were lost (printed on a
+           second line, a second after the first copy)
+  spread   time from the first to the last copy received here
+
+Copies of an event that was already printed are dropped, the way a chime should do it.
+Every event carries a datagram number that counts the events sent as datagrams since the
+doorbell booted; a jump in it is reported as missed events, all of whose copies were lost.
+The journal sequence number (seq) is printed to match an event with the journal, it has
+gaps of its own. Ctrl-C prints the totals.
+
+usage: udp_listener.py [port] [multicast group]   (default 4210, no group)
+"""
+import socket
+import struct
+import sys
+import time
+
+DATAGRAM = struct.Struct("!4sBBBBBBBBIHHIIII")
+KINDS = {0: "ring", 1: "press"}
+PRESS_TYPES = {0: "short", 1: "long", 2: "double", 3: "multi", 4: "burst"}
+SETTLE = 1.0  # seconds after the first copy until the copies of an event are counted
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 4210
+    group = sys.argv[2] if len(sys.argv) > 2 else None
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", port))
+    if group:
+        membership = struct.pack("4s4s", socket.inet_aton(group), socket.inet_aton("0.0.0.0"))
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+    sock.settimeout(SETTLE)
+    print("listening on port %d%s" % (port, " group " + group if group else ""))
+
+    events = {}      # (chip, boot, seq, kind) -> [first arrival, last arrival, received, copies]
+    done = set()     # events whose copies were counted, later copies are dropped
+    last_number = {}  # (chip, boot) -> highest datagram number seen
+    totals = {"events": 0, "copies": 0, "received": 0, "missed": 0, "rings": 0, "detect_us": 0}
+    try:
+        while True:
+            try:
+                data, address = sock.recvfrom(64)
+            except socket.timeout:
+                settle(events, done, time.monotonic(), totals)
+                continue
+            now = time.monotonic()
+            settle(events, done, now, totals)
+            if len(data) != DATAGRAM.size or data[:4] != b"DBMZ" or data[4] != 2:
+                continue
+            (_, _, kind, channel, copy, copies, press_type, count, _, seq, boot, duration,
+             uptime, chip, detect_us, number) = DATAGRAM.unpack(data)
+            key = (chip, boot, seq, kind)
+            if key in events:
+                events[key][1] = now
+                events[key][2] += 1
+                continue
+            if key in done:
+                continue  # a late copy
+            events[key] = [now, now, 1, copies]
+            totals["events"] += 1
+            if kind == 0:
+                totals["rings"] += 1
+                totals["detect_us"] += detect_us
+
+            device = (chip, boot)
+            if device in last_number and number > last_number[device] + 1:
+                totals["missed"] += number - last_number[device] - 1
+                print("%06x  missed %d event(s) before seq %d" % (chip, number - last_number[device] - 1, seq))
+            last_number[device] = max(number, last_number.get(device, number))
+
+            what = KINDS.get(kind, str(kind))
+            if kind == 1:
+                what += " %s %dx %d ms" % (PRESS_TYPES.get(press_type, str(press_type)), count, duration)
+            print("%s  %06x boot %d seq %d  channel %d  %s  first copy %d  detect %s  uptime %d ms"
+                  % (address[0], chip, boot, seq, channel, what, copy,
+                     "%d us" % detect_us if kind == 0 else "-", uptime))
+    except KeyboardInterrupt:
+        settle(events, done, float("inf"), totals)
+        n = totals["events"]
+        if n:
+            print("\n%d events, %d of %d copies received (%.1f%%), %d events missed"
+                  % (n, totals["received"], totals["copies"], totals["received"] * 100.0 / totals["copies"],
+                     totals["missed"]))
+        if totals["rings"]:
+            print("first pulse to first copy %.0f us on average" % (totals["detect_us"] / totals["rings"]))
+
+
+def settle(events, done, now, totals):
+    """Print the copies received of the events whose copies are all in by now."""
+    for key, (first, last, received, copies) in list(events.items()):
+        if now - first < SETTLE:
+            continue
+        chip, boot, seq, kind = key
+        print("%06x boot %d seq %d  copies %d/%d  spread %.1f ms"
+              % (chip, boot, seq, received, copies, (last - first) * 1000))
+        totals["received"] += received
+        totals["copies"] += copies
+        del events[key]
+        done.add(key)
+
+
+if __name__ == "__main__":
+    main()